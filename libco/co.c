@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "co.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,9 +7,28 @@
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/syscall.h>
 
 #define STACK_SIZE ((1 << 20) + 1)
-#define CO_MAX 128 
+#define CO_MAX (1 << 18)
+#define STACK_CLASS 12                  /* 4KiB, 8KiB, ..., >= 8MiB */
+#define STACK_TRACK_ENV "LIBCO_STACK_TRACK"
+#define TRACE_ENV "LIBCO_TRACE"
+#define TRACE_MAX (1 << 22)             /* switch events kept for the dump */
+#define TRACE_SLACK 1024                /* events a preempted switch may add */
+#ifndef sigev_notify_thread_id
+  #define sigev_notify_thread_id _sigev_un._tid
+#endif
+#define PREEMPT_SIG SIGURG              /* ignored by default, like Go's */
+#define CACHE_MIN 64                    /* finished coroutines kept for reuse */
+#define PREFAULT_STACK (16 << 10)       /* stack bytes co_prealloc faults in */
 
 #define EXIT_YEILD return 
 #define panic(...) { printf(__VA_ARGS__); assert(0); }
@@ -25,6 +45,11 @@
 
 /************************* API *************************/
 static void init_switch(struct co *next);
+static void co_finish();
+static void drain_inbox();
+static void idle_wait();
+static inline void lib_enter();
+static inline void lib_leave();
 /*******************************************************/
 
 enum co_status {
@@ -34,6 +59,15 @@ enum co_status {
   CO_DEAD    = 4,                 /*  dead   */
 };
 
+struct co_group {
+  struct co_group *parent;        /* group of the creator     */
+  struct co *      owner;         /* creator, NULL if none    */
+  struct co_group *onext;         /* next group of the owner  */
+  struct co *      waiter;        /* blocked in co_group_wait */
+  uint32_t         nlive;         /* live coroutines + groups */
+  bool             cancelled;
+};
+
 struct co {
   char cname[32];                 /* coroutine name      */
   uint32_t cid;                   /* coroutine id        */
@@ -44,112 +78,436 @@ struct co {
   struct co *    waiter;
   jmp_buf        context;
   int32_t        precond;         /* num waiting for complete */
-  uint8_t        stack[STACK_SIZE] __attribute__((aligned(16)));
-};
+  uint32_t       widx;            /* index in waiting list    */
+  size_t         stack_hwm;       /* stack high-water mark    */
+
+  uint64_t       stamp;           /* tsc of last state change */
+  uint64_t       run_cycles;      /* cycles on cpu            */
+  uint64_t       wait_cycles;     /* runnable, waiting cpu    */
+  uint64_t       block_cycles;    /* blocked in co_wait       */
+  uint64_t       nswitch;         /* times switched in        */
 
-struct wait_co_node {
-  struct co * this;
-  struct wait_co_node * next;
+  struct co_group *group;         /* NULL if not in a group   */
+  struct co_group *groups;        /* created and not yet freed */
+  struct co *    znext;           /* next in zombie list or cache */
+
+  bool           parked;          /* blocked in co_park       */
+  bool           permit;          /* woken before co_park     */
+  atomic_int     wake_queued;     /* already in the inbox     */
+  struct co *    wnext;           /* next in the inbox        */
+
+  bool           preemptible;     /* co_preemptible(1)        */
+  volatile int   in_lib;          /* inside libco, no async switch */
+  uint64_t       npreempt;        /* switched out by the timer */
+  uint8_t        stack[STACK_SIZE] __attribute__((aligned(16)));
 };
 
 /****************** GLOBAL VARIABLES *******************/
 static struct co *current = NULL;      // execute co in cpu
-static struct wait_co_node wait_head = { \
-                .this = NULL, .next = NULL \
-              };                       // waiting list 
+static struct co **wait_list = NULL;   // waiting list (runnable coroutines)
+static uint32_t wait_cap = 0;          // capacity of waiting list
 static uint32_t wait_nco = 0;          // wait number
-static uint8_t assign_cid[CO_MAX];     // cid assign flag
+static struct co *assign_cid[CO_MAX]; // cid -> coroutine, NULL is free
+static uint32_t last_cid = 0;          // last assigned cid
+static uint32_t max_cid = 0;           // highest cid ever assigned
+static struct co *zombie = NULL;       // dead group members to reclaim
+static struct co *co_cache = NULL;     // freed coroutines, reused by co_start
+static uint32_t cache_n = 0;           // coroutines in the cache
+static uint32_t cache_max = CACHE_MIN; // raised by co_prealloc
+
+static _Atomic(struct co *) inbox = NULL;  // co_wake from any thread (MPSC)
+static atomic_int sleeping = 0;        // engine is blocked on wake_fd
+static int wake_fd = -1;               // eventfd kicking the idle engine
+static uint32_t nparked = 0;           // coroutines blocked in co_park
+
+static volatile sig_atomic_t preempt_pending = 0;  // slice used up, yield at co_safepoint
+static bool async_switch = false;      // co_yield from preempt_handler: no heap
+static bool preempt_on = false;        // co_preempt timer armed
+static timer_t preempt_timer;
+static struct itimerspec preempt_its;  // tick period, half a slice
+static uint64_t slice_cycles = 0;      // time slice in tsc cycles
+
+static bool stack_track = false;       // LIBCO_STACK_TRACK is set
+static size_t page_size = 4096;
+static struct {
+  uint64_t ncos;                       // finished coroutines accounted
+  uint64_t nearly;                     // used more than 7/8 of the stack
+  size_t   max;                        // deepest stack seen
+  uint64_t hist[STACK_CLASS];          // by power-of-two size class
+} stack_summary;
 
 /*******************************************************/
 static void show_waiting_list() {
-  struct wait_co_node *first = wait_head.next;
+#ifdef LOCAL_MACHINE                   // O(n), keep it out of the yield path
   debug("\twaiting list [%u]: ", wait_nco);
-  while(first != NULL && first->this != NULL) {
-    debug("(%s %u)->", first->this->cname, first->this->cid);
-    first = first->next;
+  for (uint32_t i = 0; i < wait_nco; i++) {
+    debug("(%s %u)->", wait_list[i]->cname, wait_list[i]->cid);
   }
   debug("None\n\n");
+#endif
+}
+
+/* only runnable coroutines live in the waiting list: a dead coroutine or
+ * one whose precond > 0 is left out until it can be scheduled again. It
+ * has room for every cid, reserved by co_start, so a switch made from the
+ * preemption signal handler never reallocs. */
+static void reserve_wait_list(uint32_t n) {
+  if (n <= wait_cap) 
+    return;
+  while (wait_cap < n) {
+    wait_cap = wait_cap ? wait_cap * 2 : 64;
+  }
+  wait_list = (struct co **)realloc(wait_list, sizeof(struct co *) * wait_cap);
+  if (wait_list == NULL) {
+    panic("waiting list realloc fail.\n");
+  }
 }
 
 static void insert_wait_list(struct co *cot) {
-  struct wait_co_node *new_node = \
-      (struct wait_co_node *)malloc(sizeof(struct wait_co_node));
-  new_node->this = cot; 
-  new_node->next = wait_head.next;
-  wait_head.next = new_node;
-  wait_nco += 1;
+  assert(wait_nco < wait_cap);
+  cot->widx = wait_nco;
+  wait_list[wait_nco++] = cot;
 
   debug("\tinsert (%s, %u)\n", cot->cname, cot->cid);
 }
 
 static void pop_wait_list(struct co *cot) {
-  uintptr_t dels = (uintptr_t)cot;
-  struct wait_co_node *prev = &wait_head;
-  struct wait_co_node *curr = wait_head.next;
-  while (curr != NULL && (intptr_t)curr->this != dels) {
-    prev = curr;
-    curr = curr->next;
-  }
-  if (curr == NULL) 
+  uint32_t idx = cot->widx;
+  if (idx >= wait_nco || wait_list[idx] != cot) 
     return;
-  if((intptr_t)curr->this == dels) {
-    prev->next = curr->next;
-    free(curr);
-    wait_nco -= 1;
-  } else {
-    panic("delete error.\n");
-  }
+  wait_list[idx] = wait_list[--wait_nco];
+  wait_list[idx]->widx = idx;
 }
 
 static struct co *choose_co() {
-  int rnum;
-  struct wait_co_node *cptr, *pptr;
   struct co *rptr = NULL;
 
-reselect:
-  rnum = rand() % wait_nco + 1;             // range from 1 to wait_nco    
-  cptr = wait_head.next;
-  pptr = &wait_head;
+  while (wait_nco == 0) {               // idle: only parked coroutines left
+    if (nparked == 0) {
+      panic("No coroutine can be scheduled (deadlock).\n");
+    }
+    idle_wait();
+  }
+  rptr = wait_list[rand() % wait_nco];    // random pick, O(1)
+  pop_wait_list(rptr);
+
+  assert(rptr->status != CO_DEAD && rptr->precond == 0);
+  return rptr;
+}
+
+/********************** profiling **********************/
+/* Every coroutine is always in one of three timed states: on cpu (run),
+ * in the waiting list (wait) or blocked on co_wait (block). `stamp` holds
+ * the tsc of the last transition. A switch reads the tsc on each side,
+ * so time spent idle in choose_co is charged to neither coroutine. */
+static inline uint64_t co_rdtsc() {
+  uint32_t lo, hi;
+  asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static uint64_t clock_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct trace_event {
+  uint64_t start, end;            /* tsc of switch in and out */
+  uint32_t cid;
+  char     cname[32];
+};
+
+static FILE *trace_fp = NULL;          // LIBCO_TRACE output, NULL is off
+static struct trace_event *trace_buf = NULL;
+static uint32_t trace_n = 0, trace_cap = 0;
+static uint64_t trace_drop = 0;
+static uint64_t tsc_base, ns_base;     // calibration taken at init
+
+/* grown ahead by TRACE_SLACK, as a preempted switch must not realloc */
+static void trace_slice(struct co *cot, uint64_t start, uint64_t end) {
+  if (trace_n + TRACE_SLACK >= trace_cap && !async_switch) {
+    uint32_t cap = trace_cap ? trace_cap * 2 : 4096;
+    struct trace_event *buf = NULL;
+    if (cap <= TRACE_MAX) 
+      buf = (struct trace_event *)realloc(trace_buf, sizeof(*buf) * cap);
+    if (buf != NULL) {
+      trace_buf = buf, trace_cap = cap;
+    }
+  }
+  if (trace_n == trace_cap) {
+    trace_drop += 1;
+    return;
+  }
+  struct trace_event *ev = &trace_buf[trace_n++];
+  ev->start = start, ev->end = end, ev->cid = cot->cid;
+  memcpy(ev->cname, cot->cname, sizeof(ev->cname));
+  ev->cname[sizeof(ev->cname) - 1] = '\0';
+}
+
+/* a coroutine name as a JSON string body: quotes, backslashes and control
+ * characters escaped, so any name keeps the trace file valid */
+static void json_escape(char *out, const char *name) {
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+    if (*p == '"' || *p == '\\') {
+      *out++ = '\\';
+      *out++ = *p;
+    } else if (*p < 0x20) {
+      out += sprintf(out, "\\u%04x", *p);
+    } else {
+      *out++ = *p;
+    }
+  }
+  *out = '\0';
+}
+
+/* chrome://tracing (or Perfetto) format, one track per cid */
+static void trace_dump() {
+  uint64_t tsc = co_rdtsc(), ns = clock_ns();
+  double us_per_tick = (tsc > tsc_base) ? (ns - ns_base) / 1e3 / (tsc - tsc_base) : 0;
+
+  fprintf(trace_fp, "{\"traceEvents\":[\n");
+  for (uint32_t i = 0; i < trace_n; i++) {
+    struct trace_event *ev = &trace_buf[i];
+    char name[sizeof(ev->cname) * 6];   // \u00xx at worst
+    json_escape(name, ev->cname);
+    fprintf(trace_fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u," \
+                      "\"ts\":%.3f,\"dur\":%.3f}%s\n", name, (int)getpid(), ev->cid, \
+                      (ev->start - tsc_base) * us_per_tick, (ev->end - ev->start) * us_per_tick, \
+                      i + 1 < trace_n ? "," : "");
+  }
+  fprintf(trace_fp, "],\"otherData\":{\"dropped\":%llu}}\n", (unsigned long long)trace_drop);
+  fclose(trace_fp);
+  free(trace_buf);
+}
+
+static inline void sched_out(struct co *cot, uint64_t now) {
+  cot->run_cycles += now - cot->stamp;
+  if (trace_fp) {
+    trace_slice(cot, cot->stamp, now);
+  }
+  cot->stamp = now;
+}
+
+static inline void sched_in(struct co *cot, uint64_t now) {
+  cot->wait_cycles += now - cot->stamp;
+  cot->nswitch += 1;
+  cot->stamp = now;
+}
+
+static inline void sched_unblock(struct co *cot, uint64_t now) {
+  cot->block_cycles += now - cot->stamp;
+  cot->stamp = now;
+}
+
+int co_stats(void (*fn)(const struct co_stat *st, void *arg), void *arg) {
+  static const char *state[] = { "?", "new", "running", "waiting", "dead" };
+  uint64_t now = co_rdtsc();
+  int n = 0;
 
-  while(--rnum) {
-    pptr = cptr;
-    cptr = cptr->next;
+  lib_enter();
+  for (uint32_t cid = 1; cid <= max_cid; cid++) {
+    struct co *cot = assign_cid[cid];
+    if (cot == NULL) continue;
+
+    struct co_stat st = {
+      .name = cot->cname, .cid = cot->cid,
+      .state = (cot->status == CO_WAITING && cot->precond > 0) ? "blocked" : state[cot->status],
+      .run_cycles = cot->run_cycles, .wait_cycles = cot->wait_cycles,
+      .block_cycles = cot->block_cycles, .switches = cot->nswitch,
+      .preemptions = cot->npreempt,
+    };
+    // fold in the time spent in the current state
+    if (cot == current) 
+      st.run_cycles += now - cot->stamp;
+    else if (cot->status == CO_WAITING && cot->precond > 0) 
+      st.block_cycles += now - cot->stamp;
+    else if (cot->status != CO_DEAD) 
+      st.wait_cycles += now - cot->stamp;
+
+    fn(&st, arg);
+    n += 1;
   }
+  lib_leave();
+  return n;
+}
 
-  assert(cptr->this != NULL);
+/******************** stack tracking *******************/
+/* Stacks are lazily backed: a page becomes resident only when the coroutine
+ * touches it. With tracking on, co_start drops the stack pages (they may be
+ * reused heap memory) and mincore() later tells how deep the stack went. */
+static void stack_range(struct co *cot, uintptr_t *lo, uintptr_t *hi) {
+  *lo = ((uintptr_t)cot->stack + page_size - 1) & ~(page_size - 1);
+  *hi = ((uintptr_t)cot->stack + STACK_SIZE) & ~(page_size - 1);
+}
+
+static void stack_reset(struct co *cot) {
+  uintptr_t lo, hi;
+  stack_range(cot, &lo, &hi);
+  madvise((void *)lo, hi - lo, MADV_DONTNEED);
+  cot->stack_hwm = 0;
+}
+
+static size_t stack_probe(struct co *cot) {
+  static unsigned char vec[(STACK_SIZE >> 12) + 2];
+  uintptr_t lo, hi, top = (uintptr_t)cot->stack + STACK_SIZE;
+  stack_range(cot, &lo, &hi);
+
+  size_t npage = (hi - lo) / page_size, i;
+  if (mincore((void *)lo, hi - lo, vec) != 0) 
+    return cot->stack_hwm;
+  for (i = 0; i < npage && !(vec[i] & 1); i++) ;  // deepest resident page
+
+  size_t used = top - (lo + i * page_size);
+  if (used > cot->stack_hwm) 
+    cot->stack_hwm = used;
+  return cot->stack_hwm;
+}
+
+static void stack_account(struct co *cot) {
+  size_t used = stack_probe(cot);
+  int cls = 0;
+  while (cls < STACK_CLASS - 1 && (4096ul << cls) < used) cls++;
+
+  stack_summary.ncos += 1;
+  stack_summary.hist[cls] += 1;
+  if (used > stack_summary.max) 
+    stack_summary.max = used;
+  if (used > STACK_SIZE / 8 * 7) {
+    stack_summary.nearly += 1;
+    fprintf(stderr, "libco: (%s, %u) used %zu of %d stack bytes\n", \
+                    cot->cname, cot->cid, used, STACK_SIZE);
+  }
+}
 
-  if (cptr->this->status == CO_DEAD || cptr->this->precond > 0) {
-    goto reselect;
+static void stack_report() {
+  fprintf(stderr, "libco: stack usage of %llu coroutines, max %zu bytes, " \
+                  "%llu near overflow\n", (unsigned long long)stack_summary.ncos, \
+                  stack_summary.max, (unsigned long long)stack_summary.nearly);
+  for (int cls = 0; cls < STACK_CLASS; cls++) {
+    if (stack_summary.hist[cls] == 0) continue;
+    fprintf(stderr, "  %s%8lu KiB : %llu\n", cls == STACK_CLASS - 1 ? ">" : "<=", \
+                    (4096ul << cls) >> 10, (unsigned long long)stack_summary.hist[cls]);
+  }
+}
+
+size_t co_stack_usage(struct co *co) {
+  return stack_track ? stack_probe(co) : 0;
+}
+
+static void free_co(struct co *this);
+
+/****************** descriptor cache *******************/
+/* A finished coroutine goes back to a LIFO cache instead of free(), so the
+ * next co_start gets a descriptor whose header and hot stack pages are
+ * still resident (and warm in the cache): no malloc and no page fault. */
+static struct co *co_alloc() {
+  struct co *cot = co_cache;
+  if (cot != NULL) {
+    co_cache = cot->znext;
+    cache_n -= 1;
+    return cot;
+  }
+  cot = (struct co *)malloc(sizeof(struct co));
+  if (cot == NULL) {
+    panic("co malloc fail.\n");
+  }
+  return cot;
+}
+
+static void co_release(struct co *cot) {
+  if (cache_n < cache_max) {
+    cot->znext = co_cache;
+    co_cache = cot;
+    cache_n += 1;
   } else {
-    pptr->next = cptr->next;
-    rptr = cptr->this;
-    free(cptr);
-    wait_nco -= 1;
+    free(cot);
+  }
+}
+
+int co_prealloc(int n) {
+  if (n <= 0) {
+    return -1;
+  }
+  lib_enter();
+  if ((uint32_t)n > cache_max) {
+    cache_max = n;
   }
+  while (cache_n < (uint32_t)n) {
+    struct co *cot = (struct co *)malloc(sizeof(struct co));
+    if (cot == NULL) 
+      break;
+    memset(cot, 0, offsetof(struct co, stack));
+    memset(cot->stack + STACK_SIZE - PREFAULT_STACK, 0, PREFAULT_STACK);
+    co_release(cot);
+  }
+  lib_leave();
+  return cache_n;
+}
 
-  return rptr;
+/* a dead group member may still be running on its own stack, so it is
+ * freed later by the next live coroutine that enters the engine. */
+static void reclaim_zombies() {
+  while (zombie != NULL) {
+    struct co *cot = zombie;
+    zombie = cot->znext;
+    free_co(cot);
+  }
 }
 
 struct co *co_start(const char *name, void (*func)(void *), void *args) {
-  // alloc memory for 'strcut co'
-  struct co *newco = (struct co *)malloc(sizeof(struct co));
+  struct co *self = current;            // NULL for main, which becomes current
+  if (self) {
+    lib_enter();
+  }
+  if (current && current->status != CO_DEAD) {
+    reclaim_zombies();
+  }
+  // alloc memory for 'strcut co', a cached one if any
+  struct co *newco = co_alloc();
   
   // initlize
-  strncpy(newco->cname, name, strlen(name));
+  strncpy(newco->cname, name, sizeof(newco->cname) - 1);
+  newco->cname[sizeof(newco->cname) - 1] = '\0';
   newco->entry    = func;
   newco->args     = args;
   newco->status   = CO_NEW;
   newco->waiter   = NULL;
   newco->precond  = 0;                  // without waiting coroutine
+  newco->stack_hwm = 0;
+  newco->stamp        = co_rdtsc();
+  newco->run_cycles   = 0;
+  newco->wait_cycles  = 0;
+  newco->block_cycles = 0;
+  newco->nswitch      = 0;
+  newco->group    = NULL;
+  newco->groups   = NULL;
+  newco->znext    = NULL;
+  newco->parked   = false;
+  newco->permit   = false;
+  newco->wnext    = NULL;
+  newco->preemptible = false;
+  newco->in_lib   = 0;
+  newco->npreempt = 0;
+  atomic_init(&newco->wake_queued, 0);
+  if (stack_track) {
+    stack_reset(newco);
+  }
 
-  int idx = 0;
-  while(assign_cid[++idx] == 1) ;       // search empty id (0 is main routine)
+  uint32_t idx = last_cid, n = 0;      // search empty id (0 is main routine)
+  do {
+    idx = (idx + 1 < CO_MAX) ? idx + 1 : 1;
+  } while (assign_cid[idx] != NULL && ++n < CO_MAX);
   
-  if (idx == CO_MAX) {
+  if (n == CO_MAX) {
     panic("The created concurrent process reaches maximum.\n");
   }
+  last_cid = idx;
   newco->cid = idx; 
-  assign_cid[idx] = 1;
+  assign_cid[idx] = newco;
+  if (idx > max_cid) 
+    max_cid = idx;
+  reserve_wait_list(max_cid + 1);
 
   debug("create (%s, %u)\n", newco->cname, newco->cid);
 
@@ -159,19 +517,21 @@ struct co *co_start(const char *name, void (*func)(void *), void *args) {
   } else {                              // insert waiting list
     insert_wait_list(newco);  
   }
-  
+  if (self) {
+    lib_leave();
+  }
   return newco;
 }
 
 static void free_co(struct co *this) {
   this->waiter = NULL;
-  assign_cid[this->cid] = 0;
+  assign_cid[this->cid] = NULL;
   pop_wait_list(this);
   debug("-->free (%s, %u)\n", this->cname, this->cid);
 #ifdef LOCAL_MACHINE
   show_waiting_list();
 #endif
-  free(this);
+  co_release(this);
 }
 
 /********************* init and fin ********************/
@@ -179,11 +539,33 @@ __attribute__((constructor)) void init_func() {
   extern int main();
   void (*main_ptr)(void *) = (void (*)(void *))main;
   void *args = NULL;
+
+  page_size = sysconf(_SC_PAGESIZE);
+  stack_track = getenv(STACK_TRACK_ENV) != NULL;
+  tsc_base = co_rdtsc(), ns_base = clock_ns();
+  wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (getenv(TRACE_ENV) != NULL && (trace_fp = fopen(getenv(TRACE_ENV), "w")) == NULL) {
+    perror(TRACE_ENV);
+  }
   struct co *main_co = co_start("main", main_ptr, args);
 }
 
 __attribute__((destructor)) void fin_func() {
+  co_preempt(0);
+  if (trace_fp) {
+    sched_out(current, co_rdtsc());
+    trace_dump();
+  }
+  reclaim_zombies();
   free_co(current);
+  while (co_cache != NULL) {
+    struct co *cot = co_cache;
+    co_cache = cot->znext;
+    free(cot);
+  }
+  if (stack_track) {
+    stack_report();
+  }
 }
 /*******************************************************/
 
@@ -194,6 +576,7 @@ void co_wait(struct co *co) {
   if (current == co) {
     panic("Coroutine can't wait for itself.\n");
   } else {
+    lib_enter();
     switch (co->status) {
       // if precond is true, coroutine engine not yeild here.
       case CO_NEW: case CO_WAITING: 
@@ -203,7 +586,246 @@ void co_wait(struct co *co) {
     }
     // here co is finish -> yeild
     free_co(co);
+    lib_leave();
+  }
+}
+
+/*************** structured concurrency ****************/
+static void co_unblock(struct co *waiter) {
+  if (--waiter->precond == 0) {
+    sched_unblock(waiter, co_rdtsc());
+    insert_wait_list(waiter);
+  }
+}
+
+static void group_leave(struct co_group *g) {
+  if (--g->nlive == 0 && g->waiter != NULL) {
+    struct co *waiter = g->waiter;
+    g->waiter = NULL;
+    co_unblock(waiter);
+  }
+}
+
+struct co_group *co_group_new() {
+  lib_enter();
+  struct co_group *g = (struct co_group *)malloc(sizeof(struct co_group));
+  if (g == NULL) {
+    panic("co_group malloc fail.\n");
+  }
+  g->parent    = current ? current->group : NULL;
+  g->owner     = current;
+  g->onext     = NULL;
+  if (current) {
+    g->onext = current->groups;
+    current->groups = g;
+  }
+  g->waiter    = NULL;
+  g->nlive     = 0;
+  g->cancelled = false;
+  if (g->parent) {                      // parent can't be joined before us
+    g->parent->nlive += 1;
+  }
+  lib_leave();
+  return g;
+}
+
+struct co *co_group_start(struct co_group *g, const char *name, \
+                          void (*func)(void *), void *args) {
+  lib_enter();
+  struct co *newco = co_start(name, func, args);
+  newco->group = g;
+  g->nlive += 1;
+  lib_leave();
+  return newco;
+}
+
+void co_group_wait(struct co_group *g) {
+  assert(current != NULL);
+  lib_enter();
+  if (g->nlive > 0) {
+    if (g->waiter != NULL) {
+      panic("Only one coroutine can wait a group.\n");
+    }
+    g->waiter = current;
+    current->precond += 1;
+    co_yield();
+  }
+  reclaim_zombies();
+  lib_leave();
+}
+
+void co_group_cancel(struct co_group *g) {
+  g->cancelled = true;
+}
+
+void co_group_free(struct co_group *g) {
+  co_group_wait(g);
+  lib_enter();
+  if (g->owner) {
+    struct co_group **pp = &g->owner->groups;
+    while (*pp != g) pp = &(*pp)->onext;
+    *pp = g->onext;
+  }
+  if (g->parent) {
+    group_leave(g->parent);
+  }
+  free(g);
+  lib_leave();
+}
+
+int co_cancelled() {
+  for (struct co_group *g = current->group; g != NULL; g = g->parent) {
+    if (g->cancelled) return 1;
+  }
+  return 0;
+}
+
+/**************** cross-thread wakeup *****************/
+/* co_wake() is the only entry point that may run on other threads: it
+ * pushes the coroutine on a lock-free stack, which the engine drains at
+ * every scheduling point. The eventfd is written only while the engine
+ * sleeps, so the switch path never takes a lock or makes a syscall. */
+struct co *co_self() {
+  return current;
+}
+
+void co_park() {
+  assert(current != NULL);
+  if (current->permit) {                // the wakeup came first
+    current->permit = false;
+    return;
+  }
+  lib_enter();
+  current->parked = true;
+  current->precond += 1;
+  nparked += 1;
+  co_yield();
+  lib_leave();
+}
+
+void co_wake(struct co *co) {
+  if (atomic_exchange(&co->wake_queued, 1)) 
+    return;                             // still queued, wakeups coalesce
+
+  struct co *head = atomic_load(&inbox);
+  do {
+    co->wnext = head;
+  } while (!atomic_compare_exchange_weak(&inbox, &head, co));
+
+  if (atomic_load(&sleeping)) {
+    uint64_t one = 1;
+    write(wake_fd, &one, sizeof(one));
+  }
+}
+
+static void drain_inbox() {
+  struct co *cot = atomic_exchange(&inbox, NULL);
+  while (cot != NULL) {
+    struct co *next = cot->wnext;
+    atomic_store(&cot->wake_queued, 0);
+    if (cot->parked) {
+      cot->parked = false;
+      nparked -= 1;
+      co_unblock(cot);
+    } else {
+      cot->permit = true;
+    }
+    cot = next;
+  }
+}
+
+static void idle_wait() {
+  atomic_store(&sleeping, 1);
+  if (atomic_load(&inbox) == NULL) {    // re-check, co_wake may have missed us
+    uint64_t cnt;
+    if (preempt_on) {                   // no ticks while asleep
+      timer_settime(preempt_timer, 0, &(struct itimerspec){ 0 }, NULL);
+    }
+    read(wake_fd, &cnt, sizeof(cnt));
+    if (preempt_on) {
+      timer_settime(preempt_timer, 0, &preempt_its, NULL);
+    }
   }
+  atomic_store(&sleeping, 0);
+  drain_inbox();
+}
+
+/********************** preemption *********************/
+/* The timer is on the monotonic clock, as cpu-time timers only fire at
+ * the kernel tick, and idle_wait disarms it while the engine sleeps. It is
+ * delivered to the thread that armed it. It ticks every half slice, and a
+ * tick only marks the running coroutine once it has been on the cpu for a
+ * whole slice (its stamp is the tsc of the switch in). The switch is a
+ * plain co_yield, also when made from the handler: the coroutine later
+ * resumes inside the handler, whose return restores every register.
+ * SA_NODEFER keeps the signal unblocked while the handler is switched out. */
+static inline void lib_enter() {
+  current->in_lib += 1;
+  atomic_signal_fence(memory_order_seq_cst);
+}
+
+static inline void lib_leave() {
+  atomic_signal_fence(memory_order_seq_cst);
+  current->in_lib -= 1;
+}
+
+static void preempt_handler(int sig) {
+  struct co *cot = current;
+  if (cot == NULL || co_rdtsc() - cot->stamp < slice_cycles) 
+    return;
+  preempt_pending = 1;
+  if (cot->preemptible && cot->in_lib == 0) {
+    int saved = errno;
+    cot->npreempt += 1;
+    async_switch = true;
+    co_yield();
+    errno = saved;
+  }
+}
+
+/* tsc cycles in ns nanoseconds, measured against the clock since init */
+static uint64_t ns_to_cycles(uint64_t ns) {
+  uint64_t now;
+  while ((now = clock_ns()) - ns_base < 1000000) ;
+  return ns * ((double)(co_rdtsc() - tsc_base) / (now - ns_base));
+}
+
+int co_preempt(unsigned slice_us) {
+  if (slice_us == 0) {
+    if (preempt_on) {
+      timer_delete(preempt_timer);
+      preempt_on = false;
+    }
+    preempt_pending = 0;
+    return 0;
+  }
+  if (!preempt_on) {
+    struct sigaction sa = { .sa_handler = preempt_handler, .sa_flags = SA_RESTART | SA_NODEFER };
+    struct sigevent sev = { .sigev_notify = SIGEV_THREAD_ID, .sigev_signo = PREEMPT_SIG };
+    sigemptyset(&sa.sa_mask);
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (sigaction(PREEMPT_SIG, &sa, NULL) < 0 || 
+        timer_create(CLOCK_MONOTONIC, &sev, &preempt_timer) < 0) {
+      return -1;
+    }
+    preempt_on = true;
+  }
+  slice_cycles = ns_to_cycles(slice_us * 1000ull);
+  uint64_t tick = slice_us * 500ull;
+  preempt_its.it_interval.tv_sec  = preempt_its.it_value.tv_sec  = tick / 1000000000;
+  preempt_its.it_interval.tv_nsec = preempt_its.it_value.tv_nsec = tick % 1000000000;
+  return timer_settime(preempt_timer, 0, &preempt_its, NULL);
+}
+
+void co_safepoint() {
+  if (preempt_pending) {
+    current->npreempt += 1;
+    co_yield();
+  }
+}
+
+void co_preemptible(int on) {
+  current->preemptible = on;
 }
 
 static void init_switch(struct co *next) {
@@ -218,22 +840,73 @@ static void init_switch(struct co *next) {
   );
 }
 
+/* current returned from its entry or was cancelled, never returns */
+static void co_finish() {
+  struct co *cot = current;
+  lib_enter();                          // no async switch of a dying coroutine
+  cot->preemptible = false;
+  while (cot->groups != NULL) {         // cancelled before freeing its groups
+    co_group_cancel(cot->groups);
+    co_group_free(cot->groups);
+  }
+  cot->status = CO_DEAD;
+  if (stack_track) {
+    stack_account(cot);
+  }
+  if (cot->waiter != NULL) {
+    co_unblock(cot->waiter);
+  }
+  if (cot->group != NULL) {
+    group_leave(cot->group);
+    if (cot->waiter == NULL) {          // detached, reclaimed automatically
+      cot->znext = zombie;
+      zombie = cot;
+    }
+  }
+  co_yield();
+  panic("Dead coroutine is scheduled.\n");
+}
+
 void co_yield() {  
+  lib_enter();
+  /* step 0. reclaim and cancellation point. A switch made from the signal
+   * handler leaves the frees to the next plain one: malloc is not
+   * async-signal-safe. */
+  if (current->status != CO_DEAD) {
+    if (!async_switch) {
+      reclaim_zombies();
+    }
+    if (current->group != NULL && current->precond == 0 && co_cancelled() &&
+        (!async_switch || current->groups == NULL)) {
+      co_finish();
+    }
+  }
+
   /* step 1. save context environment */
   int status;
   if ((status = setjmp(current->context)) != 0) {
     // control is given to switched coroutine
+    lib_leave();
     return ;
   }
 
+  sched_out(current, co_rdtsc());
   if (current->status != CO_DEAD) {
     current->status = CO_WAITING;
+    if (current->precond == 0) {
+      insert_wait_list(current);
+    }
   }
-  insert_wait_list(current);
   current = NULL;                // the cpu is leisure
 
   /* step 2. coroutine manage engine. */
+  if (atomic_load_explicit(&inbox, memory_order_relaxed) != NULL) {
+    drain_inbox();
+  }
   struct co *next = choose_co();
+  async_switch = false;
+  preempt_pending = 0;           // a new slice starts
+  sched_in(next, co_rdtsc());    // not the out stamp: choose_co may idle_wait
   assert(next->status == CO_NEW || next->status == CO_WAITING);
   debug("\tyield to (%s, %u)\n", next->cname, next->cid);
   show_waiting_list();
@@ -242,13 +915,11 @@ void co_yield() {
     case CO_NEW:     { 
                         current = next;
                         current->status = CO_RUNNING;
-                        init_switch(next); 
+                        if (current->group == NULL || !co_cancelled()) {
+                          init_switch(next); 
+                        }
                         // when init_switch return, then next is finish
-                        current->status = CO_DEAD;
-                        if (current->waiter != NULL) {
-                          current->waiter->precond -= 1;
-                        };
-                        co_yield();
+                        co_finish();
                      }; break; 
     case CO_WAITING: { 
                         current = next;
@@ -1,8 +1,65 @@
 #ifndef _CO_H_
 #define _CO_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+struct co_stat {
+  const char *name;
+  uint32_t    cid;
+  const char *state;              /* new, running, waiting, blocked, dead */
+  uint64_t    run_cycles;         /* rdtsc cycles on cpu                  */
+  uint64_t    wait_cycles;        /* runnable, waiting in the list        */
+  uint64_t    block_cycles;       /* blocked in co_wait                   */
+  uint64_t    switches;           /* times switched in                    */
+  uint64_t    preemptions;        /* switched out by co_preempt's timer   */
+};
+
 struct co* co_start(const char *name, void (*func)(void *), void *arg);
 void       co_yield();
 void       co_wait(struct co *co);
 
+/* finished coroutines are cached for co_start to reuse, at most 64 or the
+ * largest n given to co_prealloc(n), which fills the cache with n of them,
+ * descriptor and top of stack already faulted in. Returns the cache size,
+ * -1 if n <= 0. */
+int        co_prealloc(int n);
+
+/* stack high-water mark in bytes (page granularity), needs LIBCO_STACK_TRACK */
+size_t     co_stack_usage(struct co *co);
+
+/* structured concurrency: group members are reclaimed as soon as they die
+ * (never co_wait them), co_group_free joins them all. A cancelled group
+ * finishes its members, and those of groups created by them, at their next
+ * co_yield. A group must be freed before its creator's group can be joined;
+ * a creator that finishes first cancels and frees the groups it left. */
+struct co_group *co_group_new();
+struct co*       co_group_start(struct co_group *g, const char *name, void (*func)(void *), void *arg);
+void             co_group_wait(struct co_group *g);
+void             co_group_cancel(struct co_group *g);
+void             co_group_free(struct co_group *g);
+int              co_cancelled();
+
+/* co_park blocks the current coroutine until co_wake(co) is called, which
+ * is safe from any thread (e.g. a tpool worker finishing blocking work).
+ * A wakeup that comes before co_park is kept, extra ones coalesce. */
+struct co* co_self();
+void       co_park();
+void       co_wake(struct co *co);
+
+/* opt-in preemption: co_preempt(slice_us) arms a timer on the calling
+ * thread (the one running the coroutines) that marks a coroutine which has
+ * held the cpu for a whole slice. It gives the cpu up at its next
+ * co_safepoint, or at once if it runs with co_preemptible(1). A preemptible
+ * coroutine can be switched out at any instruction outside libco, so while
+ * the flag is on it must not hold locks or call functions that are not
+ * async-signal-safe (malloc, stdio). co_preempt(0) stops the timer. */
+int        co_preempt(unsigned slice_us);
+void       co_safepoint();
+void       co_preemptible(int on);
+
+/* call fn for every coroutine not yet freed, returns the number visited.
+ * LIBCO_TRACE=<file> dumps switch events as Chrome trace JSON at exit. */
+int        co_stats(void (*fn)(const struct co_stat *st, void *arg), void *arg);
+
 #endif /* end of file. */
\ No newline at end of file
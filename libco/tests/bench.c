@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <co.h>
+
+/*
+ * libco micro benchmarks.
+ *
+ * Every result is printed as one JSON object per line on stdout, so the
+ * output can be appended to a file and compared across releases:
+ *
+ *   {"bench":"yield","bits":64,"n":100,"ops":1000000,"ns_per_op":41.2,...}
+ *
+ * Usage: libco-bench-64 [n ...]   (coroutine counts of the yield bench)
+ */
+
+#define YIELD_MIN_OPS   1000000
+#define SPAWN_OPS       100000
+#if defined(__i386__)                   /* ~1 MiB of stack per coroutine */
+#define SPAWN_BURST     256
+#else
+#define SPAWN_BURST     1000
+#endif
+#define PINGPONG_OPS    500000
+#define PREEMPT_OPS     100000000
+#define PREEMPT_SLICE   1000            /* us */
+
+#if defined(__i386__)                   /* 10000 stacks exceed the address space */
+static const int default_sizes[] = { 2, 100, 1000 };
+#else
+static const int default_sizes[] = { 2, 100, 10000, 100000 };
+#endif
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static long rss_bytes() {
+    long size = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) return 0;
+    if (fscanf(fp, "%ld %ld", &size, &resident) != 2) resident = 0;
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void report(const char *bench, long n, long ops, uint64_t ns, const char *extra) {
+    printf("{\"bench\":\"%s\",\"bits\":%d,\"n\":%ld,\"ops\":%ld,"
+           "\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f%s}\n",
+           bench, (int)(sizeof(void *) * 8), n, ops,
+           (double)ns / ops, ops * 1e9 / (ns ? ns : 1), extra);
+}
+
+// -----------------------------------------------
+// yield: ns per co_yield with n runnable coroutines, and RSS per idle one.
+
+static volatile int g_stop = 0;
+static long g_started = 0;
+static long g_yields = 0;
+
+static void yield_loop(void *arg) {
+    g_started++;
+    while (!g_stop) {
+        g_yields++;
+        co_yield();
+    }
+}
+
+static void bench_yield(long n) {
+    struct co **cos = (struct co **)malloc(sizeof(struct co *) * n);
+    if (cos == NULL) {
+        fprintf(stderr, "bench_yield: malloc fail\n");
+        return;
+    }
+    g_stop = 0, g_started = 0, g_yields = 0;
+
+    long rss_before = rss_bytes();
+    for (long i = 0; i < n; i++) {
+        cos[i] = co_start("yield", yield_loop, NULL);
+    }
+    while (g_started < n) {         // every coroutine runs once and idles
+        co_yield();
+    }
+    long rss_after = rss_bytes();
+
+    long ops = n * 10 > YIELD_MIN_OPS ? n * 10 : YIELD_MIN_OPS;
+    long base = g_yields;
+    uint64_t start = now_ns();
+    while (g_yields - base < ops) {
+        g_yields++;
+        co_yield();
+    }
+    uint64_t cost = now_ns() - start;
+    ops = g_yields - base;
+
+    g_stop = 1;
+    for (long i = 0; i < n; i++) {
+        co_wait(cos[i]);
+    }
+    free(cos);
+
+    char extra[64];
+    snprintf(extra, sizeof(extra), ",\"rss_per_co\":%ld", (rss_after - rss_before) / n);
+    report("yield", n, ops, cost, extra);
+}
+
+static long minor_faults() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+// -----------------------------------------------
+// spawn: co_start + co_wait of a coroutine that returns immediately, one
+// at a time (n = 1) or SPAWN_BURST started before the first is joined,
+// with and without co_prealloc.
+
+static void nothing(void *arg) {
+}
+
+static void bench_spawn(long n, int prealloc) {
+    static struct co *cos[SPAWN_BURST];
+    if (prealloc) {
+        co_prealloc(n);
+    }
+    long faults = minor_faults();
+    uint64_t start = now_ns();
+    for (long i = 0; i < SPAWN_OPS; i += n) {
+        for (long j = 0; j < n; j++) cos[j] = co_start("spawn", nothing, NULL);
+        for (long j = 0; j < n; j++) co_wait(cos[j]);
+    }
+    uint64_t cost = now_ns() - start;
+
+    char extra[64];
+    snprintf(extra, sizeof(extra), ",\"prealloc\":%d,\"faults_per_op\":%.2f",
+             prealloc, (double)(minor_faults() - faults) / SPAWN_OPS);
+    report("spawn", n, SPAWN_OPS, cost, extra);
+}
+
+// -----------------------------------------------
+// pingpong: round trip over a pair of one-slot channels.
+
+typedef struct Chan_t {
+    int  full;
+    long val;
+} Chan;
+
+static Chan g_ping, g_pong;
+
+static void chan_send(Chan *ch, long val) {
+    while (ch->full) co_yield();
+    ch->val  = val;
+    ch->full = 1;
+}
+
+static long chan_recv(Chan *ch) {
+    while (!ch->full) co_yield();
+    ch->full = 0;
+    return ch->val;
+}
+
+static void ping(void *arg) {
+    for (long i = 0; i < PINGPONG_OPS; i++) {
+        chan_send(&g_ping, i);
+        if (chan_recv(&g_pong) != i) {
+            fprintf(stderr, "pingpong: message lost at %ld\n", i);
+            exit(1);
+        }
+    }
+}
+
+static void pong(void *arg) {
+    for (long i = 0; i < PINGPONG_OPS; i++) {
+        chan_send(&g_pong, chan_recv(&g_ping));
+    }
+}
+
+static void bench_pingpong() {
+    uint64_t start = now_ns();
+    struct co *thd1 = co_start("ping", ping, NULL);
+    struct co *thd2 = co_start("pong", pong, NULL);
+    co_wait(thd1);
+    co_wait(thd2);
+    report("pingpong", 2, PINGPONG_OPS, now_ns() - start, "");
+}
+
+// -----------------------------------------------
+// preempt: two cpu-bound coroutines share the cpu. "coop" yields every
+// 1024 iterations, "safepoint" calls co_safepoint every iteration and
+// "async" is preemptible and calls nothing, both under a PREEMPT_SLICE
+// timer. ns_per_op is one loop iteration.
+
+enum { COOP, SAFEPOINT, ASYNC };
+static const char *modes[] = { "coop", "safepoint", "async" };
+static int g_mode;
+static uint64_t g_preemptions;
+
+static void add_preemptions(const struct co_stat *st, void *arg) {
+    if (strcmp(st->state, "running") == 0) g_preemptions += st->preemptions;
+}
+
+static void spinner(void *arg) {
+    volatile long *count = (volatile long *)arg;
+    switch (g_mode) {
+        case COOP:
+            for (long i = 0; i < PREEMPT_OPS; i++) {
+                (*count)++;
+                if ((i & 1023) == 0) co_yield();
+            }
+            break;
+        case SAFEPOINT:
+            for (long i = 0; i < PREEMPT_OPS; i++) {
+                (*count)++;
+                co_safepoint();
+            }
+            break;
+        case ASYNC:
+            co_preemptible(1);
+            for (long i = 0; i < PREEMPT_OPS; i++) {
+                (*count)++;
+            }
+            co_preemptible(0);
+            break;
+    }
+    co_stats(add_preemptions, NULL);
+}
+
+static void bench_preempt(int mode) {
+    static long counts[2];
+    g_mode = mode, g_preemptions = 0;
+    if (mode != COOP && co_preempt(PREEMPT_SLICE) < 0) {
+        perror("co_preempt");
+        return;
+    }
+    uint64_t start = now_ns();
+    struct co *thd1 = co_start("spin", spinner, &counts[0]);
+    struct co *thd2 = co_start("spin", spinner, &counts[1]);
+    co_wait(thd1);
+    co_wait(thd2);
+    uint64_t cost = now_ns() - start;
+    co_preempt(0);
+
+    char extra[96];
+    snprintf(extra, sizeof(extra), ",\"mode\":\"%s\",\"slice_us\":%d,\"preemptions\":%llu",
+             modes[mode], mode == COOP ? 0 : PREEMPT_SLICE, (unsigned long long)g_preemptions);
+    report("preempt", 2, 2l * PREEMPT_OPS, cost, extra);
+}
+
+int main(int argc, char *argv[]) {
+    setbuf(stdout, NULL);
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) bench_yield(atol(argv[i]));
+    } else {
+        for (int i = 0; i < sizeof(default_sizes) / sizeof(int); i++)
+            bench_yield(default_sizes[i]);
+    }
+    bench_spawn(1, 0);
+    bench_spawn(SPAWN_BURST, 0);
+    bench_spawn(SPAWN_BURST, 1);
+    bench_pingpong();
+    for (int mode = COOP; mode <= ASYNC; mode++) {
+        bench_preempt(mode);
+    }
+
+    return 0;
+}
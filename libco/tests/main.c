@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "co-test.h"
 
 int g_count = 0;
@@ -118,6 +120,194 @@ static void test_2() {
     q_free(queue);
 }
 
+// -----------------------------------------------
+
+static int g_looping = 0;
+
+static void looper(void *arg) {
+    g_looping++;
+    while (1) {
+        co_yield();             // cancellation point
+    }
+}
+
+static void spawner(void *arg) {
+    struct co_group *group = co_group_new();
+    for (int i = 0; i < 4; ++i) {
+        co_group_start(group, "looper", looper, NULL);
+    }
+    co_group_free(group);
+}
+
+static void count_co(const struct co_stat *st, void *arg) {
+    *(int *)arg += 1;
+}
+
+static void test_3() {
+
+    struct co_group *group = co_group_new();
+    for (int i = 0; i < 5; ++i) {
+        co_group_start(group, "spawner", spawner, NULL);
+    }
+    while (g_looping < 20) {
+        co_yield();
+    }
+
+    co_group_cancel(group);
+    co_group_free(group);
+
+    int left = 0;
+    co_stats(count_co, &left);
+    printf("%d loopers, %d coroutine left", g_looping, left);
+}
+
+// -----------------------------------------------
+
+typedef struct Job_t {
+    struct co *co;
+    int in, out;
+} Job;
+
+static void *offload(void *arg) {
+    Job *job = (Job *)arg;
+    usleep(1000 * (job->in % 5));       // blocking work on a plain thread
+    job->out = job->in * job->in;
+    co_wake(job->co);
+    return NULL;
+}
+
+static int g_sum = 0;
+
+static void requester(void *arg) {
+    Job job = { .co = co_self(), .in = (int)(intptr_t)arg };
+    pthread_t tid;
+    pthread_create(&tid, NULL, offload, &job);
+    co_park();
+    pthread_join(tid, NULL);
+    g_sum += job.out;
+}
+
+static void test_4() {
+
+    struct co_group *group = co_group_new();
+    for (int i = 1; i <= 10; ++i) {
+        co_group_start(group, "requester", requester, (void *)(intptr_t)i);
+    }
+    co_group_free(group);
+
+    printf("sum = %d", g_sum);
+}
+
+// -----------------------------------------------
+
+static volatile int g_spinning = 1;
+static volatile long g_safe = 0, g_async = 0;
+
+static void hog_safepoint(void *arg) {
+    while (g_spinning) {
+        g_safe++;
+        co_safepoint();
+    }
+}
+
+static void hog_async(void *arg) {
+    co_preemptible(1);
+    while (g_spinning) {
+        g_async++;              // never enters libco
+    }
+    co_preemptible(0);
+}
+
+static void stopper(void *arg) {
+    while (g_safe == 0 || g_async == 0) {
+        co_yield();
+    }
+    g_spinning = 0;
+}
+
+static int g_left = 0;
+
+static void leaver(void *arg) {
+    co_preemptible(1);
+    for (volatile long i = 0; i < 2000000; i++) ;
+    g_left++;                   // returns still preemptible
+}
+
+static void test_5() {
+
+    co_preempt(1000);
+    struct co *thd1 = co_start("safepoint", hog_safepoint, NULL);
+    struct co *thd2 = co_start("async", hog_async, NULL);
+    struct co *thd3 = co_start("stopper", stopper, NULL);
+
+    co_wait(thd3);
+    co_wait(thd1);
+    co_wait(thd2);
+
+    struct co *leavers[8];
+    for (int i = 0; i < 8; ++i) {
+        leavers[i] = co_start("leaver", leaver, NULL);
+    }
+    for (int i = 0; i < 8; ++i) {
+        co_wait(leavers[i]);
+    }
+    co_preempt(0);
+
+    printf("hogs stopped, %d joined", g_left);
+}
+
+// -----------------------------------------------
+
+static void short_lived(void *arg) {
+    *(int *)arg += 1;
+}
+
+static void test_6() {
+
+    int ran = 0;
+    int cached = co_prealloc(16);
+    struct co *thd1 = co_start("once", short_lived, &ran);
+    co_wait(thd1);
+    struct co *thd2 = co_start("again", short_lived, &ran);
+    co_wait(thd2);
+
+    printf("%s, %s, ran %d", cached >= 16 ? "prealloc" : "no prealloc",
+           thd1 == thd2 ? "reused" : "not reused", ran);
+}
+
+// -----------------------------------------------
+
+static void idle_spawner(void *arg) {
+    struct co_group *group = co_group_new();
+    for (int i = 0; i < 4; ++i) {
+        co_group_start(group, "looper", looper, NULL);
+    }
+    while (1) {
+        co_yield();             // cancelled with its group still live
+    }
+}
+
+static void test_7() {
+
+    g_looping = 0;
+    struct co_group *group = co_group_new();
+    for (int i = 0; i < 4; ++i) {
+        co_group_start(group, "idle-spawner", idle_spawner, NULL);
+    }
+    while (g_looping < 16) {
+        co_yield();
+    }
+
+    co_group_cancel(group);
+    co_group_free(group);
+
+    int left = 0;
+    co_stats(count_co, &left);
+    printf("%d loopers, %d coroutine left", g_looping, left);
+}
+
+// -----------------------------------------------
+
 int main() {
     setbuf(stdout, NULL);
 
@@ -127,6 +317,21 @@ int main() {
     printf("\n\nTest #2. Expect: (libco-){100, 201, 202, ..., 199}\n");
     test_2();
 
+    printf("\n\nTest #3. Expect: 20 loopers, 1 coroutine left\n");
+    test_3();
+
+    printf("\n\nTest #4. Expect: sum = 385\n");
+    test_4();
+
+    printf("\n\nTest #5. Expect: hogs stopped, 8 joined\n");
+    test_5();
+
+    printf("\n\nTest #6. Expect: prealloc, reused, ran 2\n");
+    test_6();
+
+    printf("\n\nTest #7. Expect: 16 loopers, 1 coroutine left\n");
+    test_7();
+
     printf("\n\n");
 
     return 0;
@@ -0,0 +1,258 @@
+#include "sperf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define EXPORT_VERSION  1
+#define DIFF_MIN_CALLS  100         /* fewer calls in either run: no percentile verdict */
+#define DIFF_P99_NS     10000       /* smallest p99 change that counts */
+
+static void json_str(FILE *fp, const char *s) {
+  fputc('"', fp);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+/* One syscall per line, so that diff_runs() and line tools can read it
+ * without a JSON parser. */
+static void export_json(FILE *fp, struct stat_row *rows, size_t n) {
+  fprintf(fp, "{\n  \"sperf\": %d,\n  \"command\": ", EXPORT_VERSION);
+  char cmd[4096] = "";
+  for (int i = 0; i < opts.argc; i++) {
+    size_t len = strlen(cmd);
+    snprintf(cmd + len, sizeof(cmd) - len, "%s%s", i ? " " : "", opts.argv[i]);
+  }
+  json_str(fp, cmd);
+  uint64_t calls = 0;
+  for (size_t i = 0; i < n; i++)
+    calls += rows[i].calls;
+  fprintf(fp, ",\n  \"calls\": %llu,\n  \"lost\": %llu", (unsigned long long)calls,
+          (unsigned long long)stat_lost(0));
+  fprintf(fp, ",\n  \"hist_sub_bits\": %d,\n  \"syscalls\": [\n", HIST_SUB_BITS);
+  for (size_t i = 0; i < n; i++) {
+    struct stat_row *r = &rows[i];
+    fprintf(fp, "    {\"name\": \"%s\", \"nr\": %d, \"calls\": %llu, \"total_ns\": %llu, "
+                "\"min_ns\": %llu, \"max_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu",
+            r->name, r->nr, (unsigned long long)r->calls, (unsigned long long)r->ns,
+            (unsigned long long)r->min_ns, (unsigned long long)r->max_ns, (unsigned long long)r->p50_ns,
+            (unsigned long long)r->p90_ns, (unsigned long long)r->p99_ns);
+    if (opts.cpu && r->nr >= 0) {
+      struct cpu_stat *c = &sched_stats()[r->nr];
+      fprintf(fp, ", \"cpu_ns\": %llu, \"runnable_ns\": %llu",
+              (unsigned long long)c->cpu_ns, (unsigned long long)c->runq_ns);
+    }
+    fprintf(fp, ", \"hist\": [");             /* [lowest ns of the bucket, calls] */
+    for (int b = 0, first = 1; b < HIST_BUCKETS; b++) {
+      if (r->hist[b] == 0) continue;
+      fprintf(fp, "%s[%llu, %u]", first ? "" : ", ", (unsigned long long)hist_low(b), r->hist[b]);
+      first = 0;
+    }
+    fprintf(fp, "]}%s\n", i + 1 < n ? "," : "");
+  }
+
+  size_t nt;
+  struct thread_stat *ts = thread_stats(&nt);
+  fprintf(fp, "  ],\n  \"threads\": [\n");
+  for (size_t i = 0; i < nt; i++) {
+    fprintf(fp, "    {\"tid\": %d, \"comm\": ", ts[i].tid);
+    json_str(fp, ts[i].comm);
+    fprintf(fp, ", \"calls\": %llu, \"total_ns\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu",
+            (unsigned long long)ts[i].calls, (unsigned long long)ts[i].ns,
+            (unsigned long long)ts[i].bytes_in, (unsigned long long)ts[i].bytes_out);
+    if (opts.cpu)
+      fprintf(fp, ", \"cpu_ns\": %llu, \"user_ns\": %llu, \"gap_ns\": %llu",
+              (unsigned long long)ts[i].cpu_ns, (unsigned long long)ts[i].user_ns,
+              (unsigned long long)ts[i].gap_ns);
+    fprintf(fp, "}%s\n", i + 1 < nt ? "," : "");
+  }
+
+  size_t nf, used = 0;
+  struct io_file *fs = io_files(&nf);
+  fprintf(fp, "  ],\n  \"files\": [");
+  for (size_t i = 0; i < nf; i++) {
+    if (fs[i].calls == 0) continue;
+    fprintf(fp, "%s\n    {\"path\": ", used++ ? "," : "");
+    json_str(fp, fs[i].path);
+    fprintf(fp, ", \"calls\": %llu, \"total_ns\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu}",
+            (unsigned long long)fs[i].calls, (unsigned long long)fs[i].ns,
+            (unsigned long long)fs[i].bytes_in, (unsigned long long)fs[i].bytes_out);
+  }
+  fprintf(fp, "\n  ]\n}\n");
+}
+
+/* the syscall table only, the histogram as "low:calls" pairs */
+static void export_csv(FILE *fp, struct stat_row *rows, size_t n) {
+  fprintf(fp, "name,nr,calls,total_ns,min_ns,max_ns,p50_ns,p90_ns,p99_ns,hist\n");
+  for (size_t i = 0; i < n; i++) {
+    struct stat_row *r = &rows[i];
+    fprintf(fp, "%s,%d,%llu,%llu,%llu,%llu,%llu,%llu,%llu,", r->name, r->nr,
+            (unsigned long long)r->calls, (unsigned long long)r->ns,
+            (unsigned long long)r->min_ns, (unsigned long long)r->max_ns, (unsigned long long)r->p50_ns,
+            (unsigned long long)r->p90_ns, (unsigned long long)r->p99_ns);
+    for (int b = 0, first = 1; b < HIST_BUCKETS; b++) {
+      if (r->hist[b] == 0) continue;
+      fprintf(fp, "%s%llu:%u", first ? "" : " ", (unsigned long long)hist_low(b), r->hist[b]);
+      first = 0;
+    }
+    fputc('\n', fp);
+  }
+}
+
+static int is_csv(const char *path) {
+  size_t len = strlen(path);
+  return len > 4 && strcmp(path + len - 4, ".csv") == 0;
+}
+
+int export_stat(const char *path) {
+  static struct stat_row rows[MAXSYSCALL + 64];
+  size_t n = stat_rows(rows);
+  FILE *fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+  if (fp == NULL)
+    return -1;
+  if (is_csv(path))
+    export_csv(fp, rows, n);
+  else
+    export_json(fp, rows, n);
+  return fp == stdout ? fflush(fp) : fclose(fp);
+}
+
+/* sperf diff */
+struct run_row {
+  char     name[32];
+  uint64_t calls, ns, p50_ns, p90_ns, p99_ns;
+};
+
+/* the syscall rows of a file written by -x, JSON or CSV */
+static struct run_row *load_run(const char *path, size_t *n) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror(path);
+    return NULL;
+  }
+  struct run_row *rows = NULL, r;
+  size_t cap = 0;
+  char *line = NULL;
+  size_t len = 0;
+  int csv = is_csv(path), version = -1;
+  unsigned long long calls, ns, min_ns, max_ns, p50, p90, p99;
+  *n = 0;
+  while (getline(&line, &len, fp) > 0) {
+    int ok;
+    if (csv)
+      ok = sscanf(line, "%31[^,],%*d,%llu,%llu,%llu,%llu,%llu,%llu,%llu",
+                  r.name, &calls, &ns, &min_ns, &max_ns, &p50, &p90, &p99) == 8;
+    else if (sscanf(line, " \"sperf\": %d", &version) == 1)
+      continue;
+    else
+      ok = sscanf(line, " {\"name\": \"%31[^\"]\", \"nr\": %*d, \"calls\": %llu, \"total_ns\": %llu, "
+                        "\"min_ns\": %llu, \"max_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu",
+                  r.name, &calls, &ns, &min_ns, &max_ns, &p50, &p90, &p99) == 8;
+    if (!ok)
+      continue;
+    r.calls = calls, r.ns = ns, r.p50_ns = p50, r.p90_ns = p90, r.p99_ns = p99;
+    if (*n == cap) {
+      cap = cap ? cap * 2 : 64;
+      rows = (struct run_row *)realloc(rows, cap * sizeof(struct run_row));
+    }
+    rows[(*n)++] = r;
+  }
+  free(line);
+  fclose(fp);
+  if (!csv && version != EXPORT_VERSION) {
+    fprintf(stderr, "sperf: %s: not a sperf -x file, or another version\n", path);
+    free(rows);
+    return NULL;
+  }
+  return rows;
+}
+
+static const struct run_row *run_find(const struct run_row *rows, size_t n, const char *name) {
+  for (size_t i = 0; i < n; i++) {
+    if (strcmp(rows[i].name, name) == 0)
+      return &rows[i];
+  }
+  return NULL;
+}
+
+static int filtered(const char *name) {
+  if (opts.nfilter == 0)
+    return 0;
+  for (int i = 0; i < opts.nfilter; i++) {
+    if (opts.nrs[i] == syscall_nr(name))
+      return 0;
+  }
+  return 1;
+}
+
+/* relative change in percent, a 0 baseline is an infinite change */
+static double change(uint64_t a, uint64_t b) {
+  if (a == 0)
+    return b ? INFINITY : 0;
+  return ((double)b - a) / a * 100;
+}
+
+/* a change beyond both the relative threshold and an absolute floor: +1
+ * worse, -1 better, 0 noise */
+static int verdict(uint64_t a, uint64_t b, uint64_t floor) {
+  if ((b > a ? b - a : a - b) < floor || fabs(change(a, b)) < opts.threshold)
+    return 0;
+  return b > a ? 1 : -1;
+}
+
+static void diff_row(const char *name, const struct run_row *a, const struct run_row *b, int *regressed) {
+  static const struct run_row none;
+  if (a == NULL) a = &none;
+  if (b == NULL) b = &none;
+  int v_calls = verdict(a->calls, b->calls, 1);
+  int v_ns    = verdict(a->ns, b->ns, opts.min_ms * 1e6);
+  int v_p99   = a->calls >= DIFF_MIN_CALLS && b->calls >= DIFF_MIN_CALLS ?
+                verdict(a->p99_ns, b->p99_ns, DIFF_P99_NS) : 0;
+  const char *mark = " +-";                /* 0, worse, better */
+  const char *what = v_ns > 0 || v_p99 > 0 ? "REGRESSED" : v_ns < 0 || v_p99 < 0 ? "improved" : "";
+  if (v_ns > 0 || v_p99 > 0)
+    *regressed = 1;
+
+  printf("[%-16s]\t%8llu %8llu %+8.1lf%c  %10.6lf %10.6lf %+8.1lf%c  %10.3lf %10.3lf %+8.1lf%c  %s\n", name,
+         (unsigned long long)a->calls, (unsigned long long)b->calls,
+         change(a->calls, b->calls), mark[v_calls < 0 ? 2 : v_calls],
+         a->ns / 1e9, b->ns / 1e9, change(a->ns, b->ns), mark[v_ns < 0 ? 2 : v_ns],
+         a->p99_ns / 1e3, b->p99_ns / 1e3, change(a->p99_ns, b->p99_ns), mark[v_p99 < 0 ? 2 : v_p99],
+         what);
+}
+
+/* every syscall of either run, in a's order, then the new ones of b;
+ * b regressed if any total time or p99 grew beyond the thresholds */
+int diff_runs(const char *path_a, const char *path_b) {
+  size_t na, nb;
+  struct run_row *a = load_run(path_a, &na), *b = a ? load_run(path_b, &nb) : NULL;
+  int regressed = 0;
+  if (a == NULL || b == NULL)
+    return -1;
+
+  printf("Syscall \t\t%8s %8s %9s  %10s %10s %9s  %10s %10s %9s\n",
+         "Calls a", "b", "Change(%)", "Cost a(s)", "b", "Change(%)", "p99 a(us)", "b", "Change(%)");
+  printf("===============================================================================================================\n");
+  for (size_t i = 0; i < na; i++) {
+    if (!filtered(a[i].name))
+      diff_row(a[i].name, &a[i], run_find(b, nb, a[i].name), &regressed);
+  }
+  for (size_t i = 0; i < nb; i++) {
+    if (!filtered(b[i].name) && run_find(a, na, b[i].name) == NULL)
+      diff_row(b[i].name, NULL, &b[i], &regressed);
+  }
+  printf("\n%s: thresholds %.1lf%% and %.3lf ms total, %.3lf us p99 (at least %d calls)\n",
+         regressed ? "regressed" : "no regression", opts.threshold, opts.min_ms,
+         DIFF_P99_NS / 1e3, DIFF_MIN_CALLS);
+  free(a);
+  free(b);
+  return regressed;
+}
@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include "sperf.h"
+#include "preload.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <libgen.h>
+#include <limits.h>
+#include <x86intrin.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define FLUSH_NS      10000000      /* a thread hands its buffer over at least this often */
+#define IDLE_US       1000
+
+#define ROW(name, row, ...) row,
+static const char *rows[PRELOAD_NCALL] = { PRELOAD_CALLS(ROW) "open", "openat" };
+#undef ROW
+
+static int    row_nr[PRELOAD_NCALL];      /* syscall number, -1 for libc calls */
+static char   row_on[PRELOAD_NCALL];      /* -e */
+static double ns_per_cycle;
+
+/* the library next to the sperf binary, unless $SPERF_PRELOAD says */
+static int find_library(char *path, size_t size) {
+  const char *env = getenv(PRELOAD_SO_ENV);
+  char exe[PATH_MAX];
+  if (env) {
+    snprintf(path, size, "%s", env);
+  } else {
+    ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (n < 0)
+      return -1;
+    exe[n] = '\0';
+    snprintf(path, size, "%s/sperf-preload.so", dirname(exe));
+  }
+  return access(path, R_OK);
+}
+
+static void calibrate() {
+  uint64_t ns0 = now_ns(), c0 = __rdtsc();
+  usleep(10000);
+  ns_per_cycle = (double)(now_ns() - ns0) / (__rdtsc() - c0);
+}
+
+/* everything published so far, returns the number of blocks */
+static int drain(struct preload_shm *shm) {
+  int nblock = 0;
+  for (;; nblock++) {
+    uint64_t tail = shm->tail;
+    struct preload_block *b = &shm->blocks[tail & (PRELOAD_BLOCKS - 1)];
+    if (__atomic_load_n(&b->seq, __ATOMIC_ACQUIRE) != tail + 1)
+      return nblock;
+    for (uint32_t i = 0; i < b->n && i < PRELOAD_BLOCK; i++) {
+      const struct preload_rec *r = &b->rec[i];
+      if (r->id >= PRELOAD_NCALL || !row_on[r->id])
+        continue;
+      uint64_t ns = r->cycles * ns_per_cycle;
+      if (row_nr[r->id] >= 0)
+        stat_add_nr(row_nr[r->id], ns);
+      else
+        stat_add(rows[r->id], ns);
+      thread_add(task_find(r->tid, 1), ns);
+    }
+    __atomic_store_n(&b->seq, tail + PRELOAD_BLOCKS, __ATOMIC_RELEASE);
+    shm->tail = tail + 1;
+  }
+}
+
+/* -b preload: the command runs with sperf-preload.so, which times the libc
+ * calls in PRELOAD_CALLS in-process; -1 if there is no library */
+int trace_preload() {
+  char lib[PATH_MAX], *env;
+  if (find_library(lib, sizeof(lib)) < 0) {
+    fprintf(stderr, "sperf: %s: not found, set $%s\n", lib, PRELOAD_SO_ENV);
+    return -1;
+  }
+  int fd = memfd_create("sperf-preload", 0);
+  if (fd < 0 || ftruncate(fd, sizeof(struct preload_shm)) < 0) {
+    perror("memfd_create");
+    return -1;
+  }
+  struct preload_shm *shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (shm == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  for (int i = 0; i < PRELOAD_BLOCKS; i++)
+    shm->blocks[i].seq = i;
+  calibrate();
+  shm->flush_cycles = FLUSH_NS / ns_per_cycle;
+  shm->magic = PRELOAD_MAGIC;
+
+  for (int id = 0; id < PRELOAD_NCALL; id++) {
+    row_nr[id] = syscall_nr(rows[id]);
+    row_on[id] = opts.nfilter == 0;
+    for (int i = 0; i < opts.nfilter; i++)
+      row_on[id] |= opts.nrs[i] == row_nr[id];
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  } else if (pid == 0) {                 /* child process */
+    char num[16];
+    const char *old = getenv("LD_PRELOAD");
+    snprintf(num, sizeof(num), "%d", fd);
+    setenv(PRELOAD_SHM_ENV, num, 1);
+    if (old && *old && asprintf(&env, "%s:%s", lib, old) > 0)
+      setenv("LD_PRELOAD", env, 1);
+    else
+      setenv("LD_PRELOAD", lib, 1);
+    execvp(opts.argv[0], opts.argv);
+    perror(opts.argv[0]);
+    _exit(127);
+  }
+
+  for (int done = 0; ; ) {
+    if (!done && waitpid(pid, NULL, WNOHANG) == pid)
+      done = 1;
+    if (drain(shm) == 0) {
+      if (done)
+        break;
+      usleep(IDLE_US);
+    }
+  }
+  if (shm->drops) {
+    fprintf(stderr, "sperf: %llu calls lost, sperf fell behind\n", (unsigned long long)shm->drops);
+    stat_lost(shm->drops);
+  }
+  munmap(shm, sizeof(*shm));
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,207 @@
+#include "sperf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/syscall.h>
+
+/* what a syscall does to its fd, arg0 unless noted */
+enum {
+  IO_NONE = 0,
+  IO_FD,                        /* used, no bytes (fsync, lseek, ...)   */
+  IO_IN,                        /* return value is bytes read           */
+  IO_OUT,                       /* return value is bytes written        */
+  IO_OPEN,                      /* return value is a new fd, no arg fd  */
+  IO_DUP,                       /* return value is a copy of arg0       */
+  IO_DUP2,                      /* arg1 is a copy of arg0               */
+  IO_FCNTL,                     /* IO_DUP for F_DUPFD, else IO_FD       */
+  IO_CLOSE,
+};
+
+static const unsigned char io_kind[MAXSYSCALL] = {
+  [__NR_read]     = IO_IN,    [__NR_write]    = IO_OUT,
+  [__NR_pread64]  = IO_IN,    [__NR_pwrite64] = IO_OUT,
+  [__NR_readv]    = IO_IN,    [__NR_writev]   = IO_OUT,
+  [__NR_preadv]   = IO_IN,    [__NR_pwritev]  = IO_OUT,
+  [__NR_preadv2]  = IO_IN,    [__NR_pwritev2] = IO_OUT,
+  [__NR_recvfrom] = IO_IN,    [__NR_sendto]   = IO_OUT,
+  [__NR_recvmsg]  = IO_IN,    [__NR_sendmsg]  = IO_OUT,
+  [__NR_sendfile] = IO_OUT,   [__NR_splice]   = IO_FD,
+  [__NR_copy_file_range] = IO_FD,
+  [__NR_fsync]    = IO_FD,    [__NR_fdatasync] = IO_FD,
+  [__NR_lseek]    = IO_FD,    [__NR_ioctl]    = IO_FD,
+  [__NR_getdents64] = IO_FD,  [__NR_connect]  = IO_FD,
+  [__NR_recvmmsg] = IO_FD,    [__NR_sendmmsg] = IO_FD,
+  [__NR_open]     = IO_OPEN,  [__NR_openat]   = IO_OPEN,
+  [__NR_openat2]  = IO_OPEN,  [__NR_creat]    = IO_OPEN,
+  [__NR_socket]   = IO_OPEN,  [__NR_accept4]  = IO_OPEN,
+  [__NR_dup]      = IO_DUP,   [__NR_dup2]     = IO_DUP2,
+  [__NR_dup3]     = IO_DUP2,  [__NR_fcntl]    = IO_FCNTL,
+  [__NR_close]    = IO_CLOSE,
+#ifdef __NR_accept
+  [__NR_accept]   = IO_OPEN,
+#endif
+#ifdef __NR_sendfile64
+  [__NR_sendfile64] = IO_OUT,
+#endif
+#ifdef __NR_fcntl64
+  [__NR_fcntl64]  = IO_FCNTL,
+#endif
+#ifdef __NR__llseek
+  [__NR__llseek]  = IO_FD,
+#endif
+};
+
+/* files by path, open addressing */
+static struct io_file *files = NULL;
+static size_t nfile = 0, file_cap = 0;
+static int *file_slot = NULL;           /* file + 1, 0 is empty */
+static size_t slot_cap = 0;
+
+/* (tgid, fd) -> file + 1, 0 is closed; keys are never removed, a closed
+ * fd comes back with the same key */
+static struct fd_ent {
+  uint64_t key;
+  int      file;
+} *fds = NULL;
+static size_t fd_cap = 0, nfd = 0;
+
+static void slot_grow() {
+  free(file_slot);
+  slot_cap = slot_cap ? slot_cap * 2 : 256;
+  file_slot = (int *)calloc(slot_cap, sizeof(int));
+  for (size_t i = 0; i < nfile; i++) {
+    size_t h = hash_name(files[i].path);
+    while (file_slot[h & (slot_cap - 1)]) h++;
+    file_slot[h & (slot_cap - 1)] = i + 1;
+  }
+}
+
+static int file_get(const char *path) {
+  if ((nfile + 1) * 2 > slot_cap)
+    slot_grow();
+  size_t h = hash_name(path);
+  for (;; h++) {
+    int *slot = &file_slot[h & (slot_cap - 1)];
+    if (*slot == 0) break;
+    if (strcmp(files[*slot - 1].path, path) == 0)
+      return *slot - 1;
+  }
+  if (nfile == file_cap) {
+    file_cap = file_cap ? file_cap * 2 : 64;
+    files = (struct io_file *)realloc(files, file_cap * sizeof(struct io_file));
+  }
+  struct io_file *f = &files[nfile];
+  memset(f, 0, sizeof(*f));
+  f->path = strdup(path);
+  file_slot[h & (slot_cap - 1)] = ++nfile;
+  return nfile - 1;
+}
+
+static struct fd_ent *fd_find(pid_t tgid, long fd) {
+  if ((nfd + 1) * 2 > fd_cap) {
+    struct fd_ent *old = fds;
+    size_t old_cap = fd_cap;
+    fd_cap = fd_cap ? fd_cap * 2 : 256;
+    fds = (struct fd_ent *)calloc(fd_cap, sizeof(struct fd_ent));
+    nfd = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].key)
+        *fd_find(old[i].key >> 32, (uint32_t)old[i].key) = old[i];
+    }
+    free(old);
+  }
+  uint64_t key = (uint64_t)tgid << 32 | (uint32_t)fd;
+  for (size_t i = key * 0x9e3779b97f4a7c15ull >> 40; ; i++) {
+    struct fd_ent *e = &fds[i & (fd_cap - 1)];
+    if (e->key == key)
+      return e;
+    if (e->key == 0) {
+      e->key  = key;
+      e->file = 0;
+      nfd++;
+      return e;
+    }
+  }
+}
+
+/* the fd as the kernel names it now: a path, socket:[ino], pipe:[ino] */
+static int fd_resolve(struct task *t, long fd) {
+  char link[64], path[PATH_MAX];
+  snprintf(link, sizeof(link), "/proc/%d/fd/%ld", t->tgid, fd);
+  ssize_t n = readlink(link, path, sizeof(path) - 1);
+  if (n < 0)
+    n = snprintf(path, sizeof(path), "fd %ld of %d", fd, t->tgid);
+  path[n] = '\0';
+  return file_get(path);
+}
+
+static int fd_file(struct task *t, long fd) {
+  struct fd_ent *e = fd_find(t->tgid, fd);
+  if (e->file == 0)
+    e->file = fd_resolve(t, fd) + 1;
+  return e->file - 1;
+}
+
+/* after a syscall returned, t->args holds its first arguments */
+void io_done(struct task *t, struct thread_stat *ts, long nr, long ret, uint64_t ns) {
+  int kind = nr >= 0 && nr < MAXSYSCALL ? io_kind[nr] : IO_NONE;
+  long fd = (long)t->args[0];
+  if (kind == IO_NONE)
+    return;
+  task_tgid(t);
+  if (kind == IO_FCNTL)
+    kind = (t->args[1] == F_DUPFD || t->args[1] == F_DUPFD_CLOEXEC) ? IO_DUP : IO_FD;
+
+  switch (kind) {
+    case IO_OPEN:
+      if (ret >= 0)
+        fd_find(t->tgid, ret)->file = fd_resolve(t, ret) + 1;
+      return;
+    case IO_DUP:
+    case IO_DUP2:
+      if (ret >= 0) {
+        int file = fd_file(t, fd);
+        fd_find(t->tgid, kind == IO_DUP ? ret : (long)t->args[1])->file = file + 1;
+      }
+      return;
+    case IO_CLOSE:
+      fd_find(t->tgid, fd)->file = 0;
+      return;
+  }
+
+  if (fd < 0 || fd > INT_MAX)
+    return;
+  int file = fd_file(t, fd);            /* may grow files */
+  struct io_file *f = &files[file];
+  f->calls += 1;
+  f->ns    += ns;
+  if (ret > 0 && kind == IO_IN) {
+    f->bytes_in += ret;
+    if (ts) ts->bytes_in += ret;
+  } else if (ret > 0 && kind == IO_OUT) {
+    f->bytes_out += ret;
+    if (ts) ts->bytes_out += ret;
+  }
+}
+
+int io_fd(long nr, const uint64_t *args, long ret) {
+  int kind = nr >= 0 && nr < MAXSYSCALL ? io_kind[nr] : IO_NONE;
+  if (kind == IO_NONE)
+    return -1;
+  if (kind == IO_OPEN)
+    return ret >= 0 ? ret : -1;
+  return (int)args[0];
+}
+
+int io_dir(long nr) {
+  int kind = nr >= 0 && nr < MAXSYSCALL ? io_kind[nr] : IO_NONE;
+  return kind == IO_IN ? IO_DIR_IN : kind == IO_OUT ? IO_DIR_OUT : 0;
+}
+
+struct io_file *io_files(size_t *n) {
+  *n = nfile;
+  return files;
+}
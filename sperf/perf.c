@@ -0,0 +1,327 @@
+#include "sperf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+#define RING_PAGES    512         /* data pages per cpu, power of two */
+#define POLL_MS       100
+
+/* raw_syscalls tracepoint payloads, the kernel's `long` is 64-bit */
+struct raw_enter {
+  uint16_t common_type;
+  uint8_t  common_flags, common_preempt_count;
+  int32_t  common_pid;
+  int64_t  id;
+  uint64_t args[6];
+};
+
+struct raw_exit {
+  uint16_t common_type;
+  uint8_t  common_flags, common_preempt_count;
+  int32_t  common_pid;
+  int64_t  id;
+  int64_t  ret;
+};
+
+/* PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_RAW */
+struct sample {
+  uint64_t time;
+  pid_t    pid, tid;
+  int      enter;
+  long     nr;
+  long     ret;
+  uint64_t args[2];
+};
+
+struct ring {
+  int fd;
+  struct perf_event_mmap_page *meta;
+  char *data;
+  size_t mask;
+};
+
+static struct ring *rings = NULL;
+static int nring = 0;
+static int id_enter, id_exit;
+static uint64_t nlost = 0;
+static pid_t self, only_pid;
+
+static struct sample *samples = NULL;
+static size_t nsample = 0, sample_cap = 0;
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig) {
+  stop = 1;
+}
+
+static int tracepoint_id(const char *event) {
+  static const char *roots[] = { "/sys/kernel/tracing", "/sys/kernel/debug/tracing" };
+  char path[128];
+  int id = -1;
+
+  for (int i = 0; i < sizeof(roots) / sizeof(roots[0]) && id < 0; i++) {
+    snprintf(path, sizeof(path), "%s/events/raw_syscalls/%s/id", roots[i], event);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) continue;
+    if (fscanf(fp, "%d", &id) != 1) id = -1;
+    fclose(fp);
+  }
+  return id;
+}
+
+static int open_event(int id, pid_t pid, int cpu, unsigned long flags) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type          = PERF_TYPE_TRACEPOINT;
+  attr.size          = sizeof(attr);
+  attr.config        = id;
+  attr.sample_period = 1;
+  attr.sample_type   = PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_RAW;
+  attr.disabled      = 1;
+  attr.inherit       = (pid > 0 && !(flags & PERF_FLAG_PID_CGROUP));
+  attr.use_clockid   = 1;
+  attr.clockid       = CLOCK_MONOTONIC;     /* same clock as the other backends */
+  attr.watermark     = 1;
+  attr.wakeup_watermark = RING_PAGES * 4096 / 4;
+  return syscall(SYS_perf_event_open, &attr, pid, cpu, -1, flags | PERF_FLAG_FD_CLOEXEC);
+}
+
+/* -e: "id == 0 || id == 1 ..." evaluated by the kernel before the ring */
+static int set_filter(int fd) {
+  char expr[opts.nfilter * 20 + 1];
+  size_t len = 0;
+  for (int i = 0; i < opts.nfilter; i++) {
+    len += snprintf(expr + len, sizeof(expr) - len, "%sid == %d", i ? " || " : "", opts.nrs[i]);
+  }
+  return ioctl(fd, PERF_EVENT_IOC_SET_FILTER, expr);
+}
+
+/* one ring per cpu, sys_exit is redirected into the sys_enter ring */
+static int open_rings(pid_t pid, unsigned long flags) {
+  int ncpu = sysconf(_SC_NPROCESSORS_CONF);
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  id_enter = tracepoint_id("sys_enter");
+  id_exit  = tracepoint_id("sys_exit");
+  if (id_enter < 0 || id_exit < 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  rings = (struct ring *)calloc(ncpu, sizeof(struct ring));
+  for (int cpu = 0; cpu < ncpu; cpu++) {
+    int fd_enter = open_event(id_enter, pid, cpu, flags);
+    if (fd_enter < 0 && errno == ENODEV) continue;       /* offline cpu */
+    if (fd_enter < 0) return -1;
+    int fd_exit = open_event(id_exit, pid, cpu, flags);
+    if (fd_exit < 0) return -1;
+
+    void *base = mmap(NULL, (RING_PAGES + 1) * page, PROT_READ | PROT_WRITE, MAP_SHARED, fd_enter, 0);
+    if (base == MAP_FAILED) return -1;
+    if (ioctl(fd_exit, PERF_EVENT_IOC_SET_OUTPUT, fd_enter) < 0) return -1;
+
+    struct ring *r = &rings[nring++];
+    r->fd   = fd_enter;
+    r->meta = (struct perf_event_mmap_page *)base;
+    r->data = (char *)base + page;
+    r->mask = RING_PAGES * page - 1;
+
+    if (opts.nfilter > 0 && (set_filter(fd_enter) < 0 || set_filter(fd_exit) < 0))
+      return -1;
+    ioctl(fd_enter, PERF_EVENT_IOC_ENABLE, 0);
+    ioctl(fd_exit, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  return 0;
+}
+
+static void push_sample(uint32_t *body) {
+  struct sample s;
+  s.pid  = body[0];
+  s.tid  = body[1];
+  memcpy(&s.time, body + 2, sizeof(uint64_t));
+  uint32_t size = body[4];
+  char *raw = (char *)(body + 5);
+
+  uint16_t type;
+  memcpy(&type, raw, sizeof(type));
+  if (type == id_enter && size >= sizeof(struct raw_enter)) {
+    struct raw_enter e;
+    memcpy(&e, raw, sizeof(e));
+    s.enter = 1, s.nr = e.id, s.ret = 0;
+    s.args[0] = e.args[0], s.args[1] = e.args[1];
+  } else if (type == id_exit && size >= sizeof(struct raw_exit)) {
+    struct raw_exit e;
+    memcpy(&e, raw, sizeof(e));
+    s.enter = 0, s.nr = e.id, s.ret = e.ret;
+  } else {
+    return;
+  }
+  if (s.pid == self || (only_pid && s.pid != only_pid))
+    return;
+
+  if (nsample == sample_cap) {
+    sample_cap = sample_cap ? sample_cap * 2 : 4096;
+    samples = (struct sample *)realloc(samples, sample_cap * sizeof(struct sample));
+  }
+  samples[nsample++] = s;
+}
+
+static void drain_ring(struct ring *r) {
+  uint64_t head = __atomic_load_n(&r->meta->data_head, __ATOMIC_ACQUIRE);
+  uint64_t tail = r->meta->data_tail;
+  uint64_t copy[64];
+
+  while (tail < head) {
+    struct perf_event_header *hdr = (struct perf_event_header *)(r->data + (tail & r->mask));
+    size_t off = tail & r->mask, size = hdr->size;
+
+    if (off + size > r->mask + 1 && size <= sizeof(copy)) {   /* wrapped record */
+      size_t first = r->mask + 1 - off;
+      memcpy(copy, r->data + off, first);
+      memcpy((char *)copy + first, r->data, size - first);
+      hdr = (struct perf_event_header *)copy;
+    }
+    if (hdr->type == PERF_RECORD_SAMPLE) {
+      push_sample((uint32_t *)(hdr + 1));
+    } else if (hdr->type == PERF_RECORD_LOST) {
+      nlost += ((uint64_t *)(hdr + 1))[1];
+    }
+    tail += size;
+  }
+  __atomic_store_n(&r->meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+static int cmp_sample(const void *x, const void *y) {
+  uint64_t tx = ((struct sample *)x)->time, ty = ((struct sample *)y)->time;
+  return tx < ty ? -1 : tx > ty;
+}
+
+/* Rings are per cpu, so a thread that migrated inside a syscall has its
+ * enter and exit in different rings: merge each round by time first. */
+static void drain_all() {
+  for (int i = 0; i < nring; i++)
+    drain_ring(&rings[i]);
+  qsort(samples, nsample, sizeof(struct sample), cmp_sample);
+
+  for (size_t i = 0; i < nsample; i++) {
+    struct sample *s = &samples[i];
+    struct task *t = task_find(s->tid, 1);
+    if (s->enter) {
+      t->in_syscall = 1;
+      t->nr         = s->nr;
+      t->enter_ns   = s->time;
+      t->tgid       = s->pid;
+      t->args[0]    = s->args[0];
+      t->args[1]    = s->args[1];
+#ifdef __NR_exit_group
+      if (s->nr == __NR_exit || s->nr == __NR_exit_group)
+        task_del(t);                     /* never returns */
+#endif
+    } else if (t->in_syscall && t->nr == s->nr) {
+      syscall_account(t, s->nr, s->ret, s->time - t->enter_ns);
+      if (s->nr == __NR_execve && s->ret == 0)
+        thread_exec(t);
+      t->in_syscall = 0;
+    }
+  }
+  nsample = 0;
+}
+
+/* perf_event backend: raw_syscalls tracepoints into per-cpu mmap rings.
+ * The command (if any) is run and traced with its children; with -p, -G
+ * or -a the whole system is watched, filtered in the kernel (cgroup) or
+ * here (pid), until the command exits or SIGINT. */
+int trace_perf() {
+  char **argv = opts.argv;
+  pid_t pid = opts.pid;
+  const char *cgroup = opts.cgroup;
+  int all = opts.all;
+  int gate[2] = { -1, -1 };
+  pid_t child = 0;
+  unsigned long flags = 0;
+  pid_t target = -1;
+
+  self = getpid();
+  only_pid = pid;
+  if (cgroup) {
+    if ((target = open(cgroup, O_RDONLY | O_CLOEXEC)) < 0) {
+      perror(cgroup);
+      exit(EXIT_FAILURE);
+    }
+    flags = PERF_FLAG_PID_CGROUP;
+  }
+
+  if (argv) {                            /* child waits at the gate until traced */
+    if (pipe(gate) < 0 || (child = fork()) < 0) {
+      perror("fork");
+      exit(EXIT_FAILURE);
+    }
+    if (child == 0) {
+      char go;
+      close(gate[1]);
+      if (read(gate[0], &go, 1) != 1) _exit(EXIT_FAILURE);
+      close(gate[0]);
+      execvp(argv[0], argv);
+      perror(argv[0]);
+      _exit(127);
+    }
+    close(gate[0]);
+    if (!pid && !cgroup && !all)
+      target = child;
+  }
+
+  if (open_rings(target, flags) < 0) {
+    int err = errno;
+    if (child) {
+      kill(child, SIGKILL);
+      waitpid(child, NULL, 0);
+    }
+    for (int i = 0; i < nring; i++)
+      close(rings[i].fd);
+    free(rings);
+    rings = NULL, nring = 0;
+    fprintf(stderr, "sperf: perf_event_open: %s\n", strerror(err));
+    return -1;
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  if (child) {
+    write(gate[1], "g", 1);
+    close(gate[1]);
+  }
+
+  struct pollfd pfd[nring];
+  for (int i = 0; i < nring; i++) {
+    pfd[i].fd = rings[i].fd;
+    pfd[i].events = POLLIN;
+  }
+  while (!stop) {
+    poll(pfd, nring, POLL_MS);
+    drain_all();
+    if (child && waitpid(child, NULL, WNOHANG) == child)
+      break;
+    if (pid && !child && kill(pid, 0) < 0 && errno == ESRCH)
+      break;                             /* -p target is gone */
+  }
+  drain_all();
+
+  for (int i = 0; i < nring; i++)
+    ioctl(rings[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+  stat_lost(nlost);
+  if (nlost)
+    fprintf(stderr, "sperf: %llu events lost, rings too small\n", (unsigned long long)nlost);
+  return 0;
+}
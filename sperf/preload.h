@@ -0,0 +1,76 @@
+#ifndef _PRELOAD_H_
+#define _PRELOAD_H_
+
+/* shared between sperf -b preload (interpose.c) and sperf-preload.so */
+
+#include <stdint.h>
+
+#define PRELOAD_SHM_ENV   "SPERF_SHM_FD"
+#define PRELOAD_SO_ENV    "SPERF_PRELOAD"
+#define PRELOAD_MAGIC     0x53504552464c4431ull   /* "SPERFLD1" */
+#define PRELOAD_BLOCK     256                     /* records per block */
+#define PRELOAD_BLOCKS    4096                    /* ring size, power of two */
+
+/* wrapped libc entry points: symbol, row in the table (the syscall's name
+ * when it is one), return type, parameters, arguments */
+#define PRELOAD_CALLS(_) \
+  _(read,       "read",     ssize_t, (int fd, void *buf, size_t n),                  (fd, buf, n)) \
+  _(write,      "write",    ssize_t, (int fd, const void *buf, size_t n),            (fd, buf, n)) \
+  _(pread,      "pread64",  ssize_t, (int fd, void *buf, size_t n, off_t off),       (fd, buf, n, off)) \
+  _(pwrite,     "pwrite64", ssize_t, (int fd, const void *buf, size_t n, off_t off), (fd, buf, n, off)) \
+  _(readv,      "readv",    ssize_t, (int fd, const struct iovec *iov, int n),       (fd, iov, n)) \
+  _(writev,     "writev",   ssize_t, (int fd, const struct iovec *iov, int n),       (fd, iov, n)) \
+  _(send,       "sendto",   ssize_t, (int fd, const void *buf, size_t n, int flags), (fd, buf, n, flags)) \
+  _(recv,       "recvfrom", ssize_t, (int fd, void *buf, size_t n, int flags),       (fd, buf, n, flags)) \
+  _(sendto,     "sendto",   ssize_t, (int fd, const void *buf, size_t n, int flags, __CONST_SOCKADDR_ARG a, socklen_t l), \
+                                     (fd, buf, n, flags, a, l)) \
+  _(recvfrom,   "recvfrom", ssize_t, (int fd, void *buf, size_t n, int flags, __SOCKADDR_ARG a, socklen_t *l), \
+                                     (fd, buf, n, flags, a, l)) \
+  _(sendmsg,    "sendmsg",  ssize_t, (int fd, const struct msghdr *msg, int flags),  (fd, msg, flags)) \
+  _(recvmsg,    "recvmsg",  ssize_t, (int fd, struct msghdr *msg, int flags),        (fd, msg, flags)) \
+  _(close,      "close",    int,     (int fd),                                       (fd)) \
+  _(fsync,      "fsync",    int,     (int fd),                                       (fd)) \
+  _(fdatasync,  "fdatasync", int,    (int fd),                                       (fd)) \
+  _(connect,    "connect",  int,     (int fd, __CONST_SOCKADDR_ARG a, socklen_t l),  (fd, a, l)) \
+  _(accept,     "accept",   int,     (int fd, __SOCKADDR_ARG a, socklen_t *l),       (fd, a, l)) \
+  _(poll,       "poll",     int,     (struct pollfd *fds, nfds_t n, int timeout),    (fds, n, timeout)) \
+  _(epoll_wait, "epoll_wait", int,   (int fd, struct epoll_event *ev, int n, int timeout), (fd, ev, n, timeout)) \
+  _(nanosleep,  "nanosleep", int,    (const struct timespec *req, struct timespec *rem), (req, rem)) \
+  _(pthread_mutex_lock,     "pthread_mutex_lock",     int, (pthread_mutex_t *m), (m)) \
+  _(pthread_cond_wait,      "pthread_cond_wait",      int, (pthread_cond_t *c, pthread_mutex_t *m), (c, m)) \
+  _(pthread_cond_timedwait, "pthread_cond_timedwait", int, (pthread_cond_t *c, pthread_mutex_t *m, \
+                                                            const struct timespec *t), (c, m, t)) \
+  _(pthread_join,           "pthread_join",           int, (pthread_t th, void **retval), (th, retval)) \
+  _(sem_wait,               "sem_wait",               int, (sem_t *s), (s))
+
+/* open and openat are variadic, wrapped by hand */
+#define PRELOAD_ID(name, ...) PRELOAD_##name,
+enum { PRELOAD_CALLS(PRELOAD_ID) PRELOAD_open, PRELOAD_openat, PRELOAD_NCALL };
+#undef PRELOAD_ID
+
+struct preload_rec {
+  uint64_t cycles;                /* rdtsc, end - start */
+  uint32_t id;                    /* PRELOAD_* */
+  int32_t  tid;
+};
+
+/* a thread's buffer, moved into the ring whole */
+struct preload_block {
+  uint64_t seq;                   /* Vyukov bounded queue sequence */
+  uint32_t n;
+  uint32_t pad;
+  struct preload_rec rec[PRELOAD_BLOCK];
+};
+
+/* the shared mapping: many producers (threads of all traced processes),
+ * one consumer (sperf) */
+struct preload_shm {
+  uint64_t magic;
+  uint64_t flush_cycles;          /* a thread flushes at least this often */
+  uint64_t drops;                 /* calls lost to a full ring */
+  uint64_t head __attribute__((aligned(64)));   /* next block to fill */
+  uint64_t tail __attribute__((aligned(64)));   /* next block to read */
+  struct preload_block blocks[PRELOAD_BLOCKS] __attribute__((aligned(64)));
+};
+
+#endif /* end of "preload.h" */
@@ -0,0 +1,177 @@
+/* sperf-preload.so: LD_PRELOAD'ed into the traced command by sperf -b preload.
+ * Every wrapped call is timed with rdtsc into a buffer of its thread; a full
+ * (or old) buffer is moved whole into the shared ring that sperf drains, so
+ * the hot path is two rdtsc and a store, no syscall and no lock. */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "../preload.h"
+
+static struct preload_shm *shm = NULL;
+static uint64_t flush_cycles;
+static pthread_key_t key;
+
+static __thread struct {
+  uint32_t n;
+  pid_t    tid;
+  uint64_t first;                 /* rdtsc of rec[0] */
+  struct preload_rec rec[PRELOAD_BLOCK];
+} tl;
+
+/* Vyukov's bounded MPMC queue, one consumer: a free block's seq is its
+ * position, a filled one's is position + 1 */
+static void flush() {
+  if (tl.n == 0)
+    return;
+  uint64_t pos = __atomic_load_n(&shm->head, __ATOMIC_RELAXED);
+  for (;;) {
+    struct preload_block *b = &shm->blocks[pos & (PRELOAD_BLOCKS - 1)];
+    uint64_t seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n(&shm->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        memcpy(b->rec, tl.rec, tl.n * sizeof(tl.rec[0]));
+        b->n = tl.n;
+        __atomic_store_n(&b->seq, pos + 1, __ATOMIC_RELEASE);
+        break;
+      }
+    } else if (seq < pos) {       /* ring full, sperf is behind */
+      __atomic_fetch_add(&shm->drops, tl.n, __ATOMIC_RELAXED);
+      break;
+    } else {
+      pos = __atomic_load_n(&shm->head, __ATOMIC_RELAXED);
+    }
+  }
+  tl.n = 0;
+}
+
+static void thread_exit(void *arg) {
+  flush();
+}
+
+static void after_fork() {
+  tl.n   = 0;                     /* the parent's calls, not ours */
+  tl.tid = 0;
+}
+
+__attribute__((constructor)) static void preload_init() {
+  const char *env = getenv(PRELOAD_SHM_ENV);
+  if (env == NULL)
+    return;
+  void *p = mmap(NULL, sizeof(struct preload_shm), PROT_READ | PROT_WRITE, MAP_SHARED, atoi(env), 0);
+  if (p == MAP_FAILED || ((struct preload_shm *)p)->magic != PRELOAD_MAGIC)
+    return;
+  flush_cycles = ((struct preload_shm *)p)->flush_cycles;
+  pthread_key_create(&key, thread_exit);
+  pthread_atfork(NULL, NULL, after_fork);
+  shm = p;                        /* the fd stays open for exec'ed children */
+}
+
+/* exit() runs no thread destructors */
+__attribute__((destructor)) static void preload_fini() {
+  if (shm)
+    flush();
+}
+
+static inline void record(int id, uint64_t start) {
+  uint64_t end = __rdtsc();
+  if (shm == NULL)
+    return;
+  int saved = errno;
+  if (tl.tid == 0) {
+    tl.tid = syscall(SYS_gettid);
+    pthread_setspecific(key, &tl);
+  }
+  if (tl.n == 0)
+    tl.first = start;
+  tl.rec[tl.n++] = (struct preload_rec) { .cycles = end - start, .id = id, .tid = tl.tid };
+  if (tl.n == PRELOAD_BLOCK || end - tl.first > flush_cycles)
+    flush();
+  errno = saved;
+}
+
+/* the condition variables exported by name are the pre-2.3.2 ones */
+static void *next(const char *name) {
+  void *fn = NULL;
+  if (strncmp(name, "pthread_cond_", 13) == 0)
+    fn = dlvsym(RTLD_NEXT, name, "GLIBC_2.3.2");
+  return fn ? fn : dlsym(RTLD_NEXT, name);
+}
+
+#define WRAP(name, row, type, params, args)                          \
+  type name params {                                                 \
+    static type (*real) params = NULL;                               \
+    if (real == NULL)                                                \
+      real = (type (*) params)next(#name);                           \
+    uint64_t start = __rdtsc();                                      \
+    type ret = real args;                                            \
+    record(PRELOAD_##name, start);                                   \
+    return ret;                                                      \
+  }
+
+PRELOAD_CALLS(WRAP)
+
+/* the mode is there only when the flags create a file */
+#define HAS_MODE(flags) (((flags) & O_CREAT) || ((flags) & O_TMPFILE) == O_TMPFILE)
+
+int open(const char *path, int flags, ...) {
+  static int (*real)(const char *, int, ...) = NULL;
+  mode_t mode = 0;
+  if (HAS_MODE(flags)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+  if (real == NULL)
+    real = (int (*)(const char *, int, ...))next("open");
+  uint64_t start = __rdtsc();
+  int ret = real(path, flags, mode);
+  record(PRELOAD_open, start);
+  return ret;
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+  static int (*real)(int, const char *, int, ...) = NULL;
+  mode_t mode = 0;
+  if (HAS_MODE(flags)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+  if (real == NULL)
+    real = (int (*)(int, const char *, int, ...))next("openat");
+  uint64_t start = __rdtsc();
+  int ret = real(dirfd, path, flags, mode);
+  record(PRELOAD_openat, start);
+  return ret;
+}
+
+/* the library is 64-bit only, where off_t is off64_t and O_LARGEFILE is
+ * implied, so the 64-bit names (_FILE_OFFSET_BITS=64) are the same calls.
+ * The _2 checked variants (_FORTIFY_SOURCE) never take a mode. */
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+int openat64(int dirfd, const char *path, int flags, ...) __attribute__((alias("openat")));
+ssize_t pread64(int fd, void *buf, size_t n, off64_t off) __attribute__((alias("pread")));
+ssize_t pwrite64(int fd, const void *buf, size_t n, off64_t off) __attribute__((alias("pwrite")));
+
+int __open_2(const char *path, int flags) { return open(path, flags); }
+int __open64_2(const char *path, int flags) { return open(path, flags); }
+int __openat_2(int dirfd, const char *path, int flags) { return openat(dirfd, path, flags); }
+int __openat64_2(int dirfd, const char *path, int flags) { return openat(dirfd, path, flags); }
@@ -0,0 +1,288 @@
+#include "sperf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/user.h>
+#include <sys/prctl.h>
+#include <stddef.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#define PTRACE_OPTIONS (PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | \
+                        PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | \
+                        PTRACE_O_TRACEEXEC | PTRACE_O_TRACESECCOMP)
+
+#if __x86_64__
+  #define AUDIT_ARCH_SELF AUDIT_ARCH_X86_64
+#else
+  #define AUDIT_ARCH_SELF AUDIT_ARCH_I386
+#endif
+
+static char wanted[MAXSYSCALL];      /* -e when attached, no seccomp there */
+static int  filter_here = 0;
+static pid_t attached = 0;
+static volatile sig_atomic_t stop = 0;
+
+/* stops of a syscall that -e leaves out, on an attached tracee */
+static inline int unwanted(long nr) {
+  return filter_here && (nr < 0 || nr >= MAXSYSCALL || !wanted[nr]);
+}
+
+static void syscall_done(struct task *t, long nr, long ret, uint64_t now) {
+  if (unwanted(nr))
+    return;
+  syscall_account(t, nr, ret, now - t->enter_ns);
+  if (opts.cpu)
+    sched_exit(t, nr, now);
+}
+
+static void syscall_enter(struct task *t, long nr, uint64_t arg0, uint64_t arg1, uint64_t now) {
+  t->in_syscall = 1;
+  t->nr         = nr;
+  t->enter_ns   = now;
+  t->args[0]    = arg0;
+  t->args[1]    = arg1;
+  if (unwanted(nr))             // as syscall_done: no stack, no sched split
+    return;
+  if (opts.stacks)
+    t->stack    = stack_capture(t, nr);
+  if (opts.cpu)
+    sched_enter(t, now);
+}
+
+/* syscall-enter/exit or seccomp stop: binary record, no text round trip */
+static void syscall_stop(struct task *t, int seccomp) {
+  uint64_t now = now_ns();
+#ifdef PTRACE_GET_SYSCALL_INFO
+  struct __ptrace_syscall_info info;
+  if (ptrace(PTRACE_GET_SYSCALL_INFO, t->tid, sizeof(info), &info) > 0) {
+    switch (info.op) {
+      case PTRACE_SYSCALL_INFO_ENTRY:
+        if (t->in_syscall && t->nr == info.entry.nr) {
+          t->resume = PTRACE_SYSCALL;    /* already seen at the seccomp stop */
+          break;
+        }
+        syscall_enter(t, info.entry.nr, info.entry.args[0], info.entry.args[1], now);
+        break;
+      case PTRACE_SYSCALL_INFO_SECCOMP:
+        syscall_enter(t, info.seccomp.nr, info.seccomp.args[0], info.seccomp.args[1], now);
+        t->resume     = PTRACE_SYSCALL;  /* stop once more at the exit */
+        break;
+      case PTRACE_SYSCALL_INFO_EXIT:
+        if (t->in_syscall)
+          syscall_done(t, t->nr, info.exit.rval, now);
+        t->in_syscall = 0;
+        break;
+    }
+    return;
+  }
+#endif
+  /* kernel < 5.3: read the registers and toggle entry/exit ourselves */
+  struct user_regs_struct regs;
+  if (ptrace(PTRACE_GETREGS, t->tid, NULL, &regs) < 0)
+    return;
+#if __x86_64__
+  long nr = regs.orig_rax, ret = regs.rax;
+  uint64_t arg0 = regs.rdi, arg1 = regs.rsi;
+#else
+  long nr = regs.orig_eax, ret = regs.eax;
+  uint64_t arg0 = regs.ebx, arg1 = regs.ecx;
+#endif
+  if (seccomp) {
+    syscall_enter(t, nr, arg0, arg1, now);
+    t->seccomp = 1;
+    t->resume  = PTRACE_SYSCALL;         /* stop once more at the exit */
+  } else if (t->seccomp && t->in_syscall && nr == t->nr && ret == -ENOSYS) {
+    t->seccomp = 0;                      /* the enter stop after the seccomp stop */
+    t->resume  = PTRACE_SYSCALL;
+  } else if (!t->in_syscall) {
+    syscall_enter(t, nr, arg0, arg1, now);
+  } else {
+    syscall_done(t, t->nr, ret, now);
+    t->in_syscall = 0;
+    t->seccomp    = 0;
+  }
+}
+
+/* Only the filtered syscalls stop the tracee: the kernel returns
+ * SECCOMP_RET_TRACE for them and lets everything else run at full speed.
+ * Syscalls of a foreign ABI (int 0x80 from a 64-bit process) are allowed. */
+static void install_filter(const int *nrs, int n) {
+  struct sock_filter prog[2 * n + 5];
+  int k = 0;
+
+  prog[k++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch));
+  prog[k++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_SELF, 1, 0);
+  prog[k++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+  prog[k++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr));
+  for (int i = 0; i < n; i++) {
+    prog[k++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, nrs[i], 0, 1);
+    prog[k++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE);
+  }
+  prog[k++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+
+  struct sock_fprog fprog = { .len = k, .filter = prog };
+  if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0 ||
+      prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &fprog) < 0) {
+    perror("seccomp");
+    _exit(EXIT_FAILURE);
+  }
+}
+
+/* Ctrl-C: the interrupt stop wakes the waitpid() below, so there is no
+ * window where the flag is set but the tracer sleeps on */
+static void on_signal(int sig) {
+  stop = 1;
+  ptrace(PTRACE_INTERRUPT, attached, NULL, NULL);
+}
+
+static void interrupt_task(struct task *t) {
+  ptrace(PTRACE_INTERRUPT, t->tid, NULL, NULL);
+}
+
+/* seize every thread in /proc/PID/task, again until a pass finds no new
+ * one: threads cloned meanwhile by seized ones are attached by the kernel */
+static int attach_all(pid_t pid) {
+  char path[64];
+  int found = 1, nseized = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/task", pid);
+  while (found) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) 
+      return -1;
+    found = 0;
+    for (struct dirent *de; (de = readdir(dir)) != NULL; ) {
+      pid_t tid = atoi(de->d_name);
+      if (tid <= 0 || task_find(tid, 0)) continue;
+      if (ptrace(PTRACE_SEIZE, tid, NULL, PTRACE_OPTIONS) < 0) {
+        if (errno == EPERM && nseized == 0) {
+          closedir(dir);
+          return -1;
+        }
+        continue;                        /* gone, or already ours by clone */
+      }
+      task_find(tid, 1)->fresh = 0;
+      ptrace(PTRACE_INTERRUPT, tid, NULL, NULL);
+      nseized++, found = 1;
+    }
+    closedir(dir);
+  }
+  return 0;
+}
+
+/* stop every thread once more and let it go, forwarding a signal that was
+ * about to be delivered so the target does not lose it */
+static void detach_all() {
+  int status;
+  siginfo_t si;
+
+  task_each(interrupt_task);
+  while (task_count() > 0) {
+    pid_t tid = waitpid(-1, &status, __WALL);
+    if (tid < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    struct task *t = task_find(tid, 1);
+    int sig = WIFSTOPPED(status) ? WSTOPSIG(status) : 0, inject = 0;
+    if (sig && sig != (SIGTRAP | 0x80) && status >> 16 == 0 &&
+        ptrace(PTRACE_GETSIGINFO, tid, NULL, &si) == 0)
+      inject = sig;
+    if (sig) 
+      ptrace(PTRACE_DETACH, tid, NULL, inject);
+    task_del(t);
+  }
+}
+
+/* native backend: trace the command and all its threads and children,
+ * or attach to -p PID and its threads; only the -e syscalls if any */
+int trace_ptrace() {
+  int status;
+  int resume = opts.nfilter > 0 && !opts.pid ? PTRACE_CONT : PTRACE_SYSCALL;
+  pid_t pid;
+
+  if (opts.pid) {
+    for (int i = 0; i < opts.nfilter; i++)
+      wanted[opts.nrs[i]] = 1;
+    filter_here = opts.nfilter > 0;
+    if (attach_all(opts.pid) < 0) 
+      return -1;
+    attached = opts.pid;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;           /* no SA_RESTART, waitpid returns */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+  } else if ((pid = fork()) < 0) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  } else if (pid == 0) {                 /* child process */
+    if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+      _exit(EXIT_FAILURE);               /* parent sees an exit, not a stop */
+    raise(SIGSTOP);
+    if (opts.nfilter > 0)
+      install_filter(opts.nrs, opts.nfilter);
+    execvp(opts.argv[0], opts.argv);
+    perror(opts.argv[0]);
+    _exit(127);
+  } else {
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+      return -1;
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_OPTIONS | PTRACE_O_EXITKILL);
+    task_find(pid, 1)->fresh = 0;
+    ptrace(resume, pid, NULL, NULL);
+  }
+
+  while (task_count() > 0) {
+    if (stop) {
+      detach_all();
+      break;
+    }
+    pid_t tid = waitpid(-1, &status, __WALL);
+    if (tid < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    struct task *t = task_find(tid, 1);  /* a new thread may stop before its creator reports */
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      task_del(t);
+      continue;
+    }
+    if (attached) 
+      t->fresh = 0;                      /* seized tasks get no initial SIGSTOP */
+
+    int sig = WSTOPSIG(status), inject = 0;
+    siginfo_t si;
+    t->resume = resume;
+    if (sig == (SIGTRAP | 0x80)) {       /* syscall stop */
+      syscall_stop(t, 0);
+    } else if (status >> 16 == PTRACE_EVENT_SECCOMP) {
+      syscall_stop(t, 1);
+    } else if (status >> 16 == PTRACE_EVENT_STOP && sig != SIGTRAP) {
+      t->resume = PTRACE_LISTEN;         /* group-stop of a seized task */
+    } else if (status >> 16 == PTRACE_EVENT_EXEC) {
+      thread_exec(t);
+      if (opts.stacks)
+        stack_exec(t);
+    } else if (status >> 16) {           /* clone, fork, vfork event or interrupt */
+      /* nothing to do, new tasks are attached by the kernel */
+    } else if (sig == SIGSTOP && t->fresh) {
+      t->fresh = 0;
+    } else if (ptrace(PTRACE_GETSIGINFO, tid, NULL, &si) == 0) {
+      inject = sig;                      /* signal-delivery-stop */
+    }
+    ptrace(t->resume, tid, NULL, inject);
+  }
+
+  return 0;
+}
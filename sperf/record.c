@@ -0,0 +1,126 @@
+#include "sperf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define REC_BUFS      8
+#define REC_EVENTS    (1 << 15)     /* per buffer, 1.25 MB */
+
+/* The tracer fills one buffer while the writer thread writes the others:
+ * one producer and one consumer on a ring of buffers, so the two only
+ * meet in the counting semaphores, which do not block while the ring is
+ * neither empty nor full. */
+static struct trace_event *bufs[REC_BUFS];
+static size_t   lens[REC_BUFS];
+static unsigned head = 0;           /* buffer being filled, tracer only */
+static size_t   fill = 0;
+static sem_t    full, empty;
+static pthread_t writer;
+static int      out_fd = -1;
+static uint64_t nevent = 0, werror = 0;
+
+static void *writer_main(void *arg) {
+  for (unsigned tail = 0; ; tail++) {
+    sem_wait(&full);
+    size_t len = lens[tail % REC_BUFS];
+    if (len == 0)
+      break;                            /* record_close() */
+    const char *p = (const char *)bufs[tail % REC_BUFS];
+    size_t left = len * sizeof(struct trace_event);
+    while (left > 0) {
+      ssize_t n = write(out_fd, p, left);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        werror = errno ? errno : EIO;
+        break;
+      }
+      p += n, left -= n;
+    }
+    sem_post(&empty);
+  }
+  return NULL;
+}
+
+/* hand the filled buffer over, wait only if all others are still queued */
+static void rec_flush() {
+  lens[head % REC_BUFS] = fill;
+  sem_post(&full);
+  sem_wait(&empty);
+  head++;
+  fill = 0;
+}
+
+static inline struct trace_event *rec_next() {
+  if (fill == REC_EVENTS)
+    rec_flush();
+  nevent++;
+  return &bufs[head % REC_BUFS][fill++];
+}
+
+int record_open(const char *path) {
+  struct trace_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+  hdr.version    = TRACE_VERSION;
+  hdr.event_size = sizeof(struct trace_event);
+  hdr.abi        = sizeof(long) * 8;
+  hdr.start_ns   = now_ns();
+
+  if ((out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    return -1;
+  if (write(out_fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+    return -1;
+  for (int i = 0; i < REC_BUFS; i++) {
+    if ((bufs[i] = (struct trace_event *)malloc(REC_EVENTS * sizeof(struct trace_event))) == NULL)
+      return -1;
+  }
+  sem_init(&full, 0, 0);
+  sem_init(&empty, 0, REC_BUFS - 1);  /* the tracer holds one */
+  return pthread_create(&writer, NULL, writer_main, NULL) == 0 ? 0 : -1;
+}
+
+void record_add(struct task *t, long nr, long ret, uint64_t ns) {
+  struct trace_event *e = rec_next();
+  e->ts   = t->enter_ns;
+  e->dur  = ns;
+  e->ret  = ret;
+  e->tid  = t->tid;
+  e->nr   = nr;
+  e->fd   = io_fd(nr, t->args, ret);
+  e->type = EV_SYSCALL;
+}
+
+/* the thread's name from here on, packed into dur and ret */
+void record_comm(pid_t tid, const char *comm) {
+  struct trace_event *e = rec_next();
+  char name[16] = { 0 };
+  strncpy(name, comm, sizeof(name) - 1);
+  e->ts   = now_ns();
+  memcpy(&e->dur, name, 8);
+  memcpy(&e->ret, name + 8, 8);
+  e->tid  = tid;
+  e->nr   = -1;
+  e->fd   = -1;
+  e->type = EV_COMM;
+}
+
+void record_close() {
+  if (fill > 0)
+    rec_flush();
+  lens[head % REC_BUFS] = 0;
+  sem_post(&full);
+  pthread_join(writer, NULL);
+  close(out_fd);
+
+  if (werror)
+    fprintf(stderr, "sperf: %s: %s\n", opts.record, strerror(werror));
+  else
+    fprintf(stderr, "sperf: %llu events written to %s\n", (unsigned long long)nevent, opts.record);
+  for (int i = 0; i < REC_BUFS; i++)
+    free(bufs[i]);
+}
@@ -0,0 +1,266 @@
+#include "sperf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define WIN_MAX       1024
+
+struct tid_agg {
+  pid_t    tid;
+  char     comm[16];
+  uint64_t comm_ts;
+  uint64_t calls, ns, bytes_in, bytes_out;
+};
+
+/* one worker's slice of the file and everything it found there, merged
+ * once at the end so the workers share nothing while they run */
+struct agg {
+  const struct trace_event *ev;
+  size_t   n;
+  uint64_t calls[MAXSYSCALL], ns[MAXSYSCALL], min_ns[MAXSYSCALL], max_ns[MAXSYSCALL];
+  uint32_t hist[MAXSYSCALL][HIST_BUCKETS];
+  struct tid_agg *tids;                 /* in order of first event */
+  size_t   ntid, tid_cap;
+  uint32_t *tid_slot;                   /* open addressing on tid, index + 1 */
+  uint64_t win_calls[WIN_MAX], win_ns[WIN_MAX];
+  uint64_t (*win_nr_ns)[MAXSYSCALL];    /* per window and syscall, -w only */
+};
+
+static char     wanted[MAXSYSCALL];
+static uint64_t t0, win_len;
+static int      nwin = 0;
+static struct agg *total = NULL;        /* merged windows for report_windows() */
+
+/* the slot table has twice the entries of tids, so it stays half empty */
+static void tid_grow(struct agg *a) {
+  a->tid_cap = a->tid_cap ? a->tid_cap * 2 : 64;
+  a->tids = (struct tid_agg *)realloc(a->tids, a->tid_cap * sizeof(struct tid_agg));
+  free(a->tid_slot);
+  a->tid_slot = (uint32_t *)calloc(a->tid_cap * 2, sizeof(uint32_t));
+  if (a->tids == NULL || a->tid_slot == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  size_t mask = a->tid_cap * 2 - 1;
+  for (size_t k = 0; k < a->ntid; k++) {
+    size_t i = (size_t)a->tids[k].tid & mask;
+    while (a->tid_slot[i]) i = (i + 1) & mask;
+    a->tid_slot[i] = k + 1;
+  }
+}
+
+static struct tid_agg *tid_get(struct agg *a, pid_t tid) {
+  if (a->ntid == a->tid_cap)
+    tid_grow(a);
+  size_t mask = a->tid_cap * 2 - 1, i = (size_t)tid & mask;
+  for (; a->tid_slot[i]; i = (i + 1) & mask) {
+    struct tid_agg *t = &a->tids[a->tid_slot[i] - 1];
+    if (t->tid == tid)
+      return t;
+  }
+  struct tid_agg *t = &a->tids[a->ntid];
+  memset(t, 0, sizeof(*t));
+  t->tid = tid;
+  a->tid_slot[i] = ++a->ntid;
+  return t;
+}
+
+static void *worker(void *arg) {
+  struct agg *a = arg;
+
+  for (int nr = 0; nr < MAXSYSCALL; nr++)
+    a->min_ns[nr] = UINT64_MAX;
+  for (size_t i = 0; i < a->n; i++) {
+    const struct trace_event *e = &a->ev[i];
+    if (e->type == EV_COMM) {
+      struct tid_agg *t = tid_get(a, e->tid);
+      if (e->ts >= t->comm_ts) {
+        memcpy(t->comm, &e->dur, 8);
+        memcpy(t->comm + 8, &e->ret, 8);
+        t->comm[15] = '\0';
+        t->comm_ts = e->ts;
+      }
+      continue;
+    }
+    int nr = e->nr;
+    if (e->type != EV_SYSCALL || nr < 0 || nr >= MAXSYSCALL) continue;
+    if (opts.nfilter && !wanted[nr]) continue;
+
+    uint64_t ns = e->dur;
+    a->calls[nr] += 1;
+    a->ns[nr]    += ns;
+    if (ns < a->min_ns[nr]) a->min_ns[nr] = ns;
+    if (ns > a->max_ns[nr]) a->max_ns[nr] = ns;
+    a->hist[nr][hist_bucket(ns)]++;
+
+    struct tid_agg *t = tid_get(a, e->tid);
+    int dir = io_dir(nr);
+    t->calls += 1;
+    t->ns    += ns;
+    if (e->ret > 0 && dir == IO_DIR_IN)  t->bytes_in  += e->ret;
+    if (e->ret > 0 && dir == IO_DIR_OUT) t->bytes_out += e->ret;
+
+    if (nwin) {
+      uint64_t w = e->ts > t0 ? (e->ts - t0) / win_len : 0;
+      if (w >= nwin) w = nwin - 1;
+      a->win_calls[w] += 1;
+      a->win_ns[w]    += ns;
+      a->win_nr_ns[w][nr] += ns;
+    }
+  }
+  return NULL;
+}
+
+static int cmp_tid(const void *x, const void *y) {
+  return ((struct tid_agg *)x)->tid - ((struct tid_agg *)y)->tid;
+}
+
+static void merge(struct agg *as, int n) {
+  total = &as[0];
+  for (int j = 1; j < n; j++) {
+    for (int nr = 0; nr < MAXSYSCALL; nr++) {
+      if (as[j].calls[nr] == 0) continue;
+      if (as[j].min_ns[nr] < total->min_ns[nr]) total->min_ns[nr] = as[j].min_ns[nr];
+      if (as[j].max_ns[nr] > total->max_ns[nr]) total->max_ns[nr] = as[j].max_ns[nr];
+      total->calls[nr] += as[j].calls[nr];
+      total->ns[nr]    += as[j].ns[nr];
+      for (int b = 0; b < HIST_BUCKETS; b++)
+        total->hist[nr][b] += as[j].hist[nr][b];
+    }
+    for (int w = 0; w < nwin; w++) {
+      total->win_calls[w] += as[j].win_calls[w];
+      total->win_ns[w]    += as[j].win_ns[w];
+      for (int nr = 0; nr < MAXSYSCALL; nr++)
+        total->win_nr_ns[w][nr] += as[j].win_nr_ns[w][nr];
+    }
+  }
+  for (int nr = 0; nr < MAXSYSCALL; nr++)
+    stat_merge(nr, total->calls[nr], total->ns[nr], total->min_ns[nr], total->max_ns[nr], total->hist[nr]);
+
+  /* threads: all slices side by side, then one row per tid */
+  size_t ntid = 0;
+  for (int j = 0; j < n; j++)
+    ntid += as[j].ntid;
+  struct tid_agg *all = (struct tid_agg *)malloc((ntid + 1) * sizeof(struct tid_agg));
+  ntid = 0;
+  for (int j = 0; j < n; j++) {
+    memcpy(all + ntid, as[j].tids, as[j].ntid * sizeof(struct tid_agg));
+    ntid += as[j].ntid;
+  }
+  qsort(all, ntid, sizeof(all[0]), cmp_tid);
+  for (size_t i = 0; i < ntid; ) {
+    struct tid_agg t = all[i++];
+    for (; i < ntid && all[i].tid == t.tid; i++) {
+      t.calls += all[i].calls, t.ns += all[i].ns;
+      t.bytes_in += all[i].bytes_in, t.bytes_out += all[i].bytes_out;
+      if (all[i].comm_ts >= t.comm_ts && all[i].comm[0]) {
+        memcpy(t.comm, all[i].comm, sizeof(t.comm));
+        t.comm_ts = all[i].comm_ts;
+      }
+    }
+    if (t.calls == 0) continue;
+    struct thread_stat *ts = thread_put(t.tid, t.comm[0] ? t.comm : "?");
+    ts->calls = t.calls, ts->ns = t.ns;
+    ts->bytes_in = t.bytes_in, ts->bytes_out = t.bytes_out;
+  }
+  free(all);
+}
+
+/* sperf report: the file is mapped and cut into one slice per thread */
+int report(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    return -1;
+  }
+  if (st.st_size < sizeof(struct trace_header)) {
+    fprintf(stderr, "sperf: %s: not a sperf record file\n", path);
+    return -1;
+  }
+  const char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  const struct trace_header *hdr = (const struct trace_header *)base;
+  if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != TRACE_VERSION ||
+      hdr->event_size != sizeof(struct trace_event)) {
+    fprintf(stderr, "sperf: %s: not a sperf record file, or another version\n", path);
+    return -1;
+  }
+  if (hdr->abi != sizeof(long) * 8) {
+    fprintf(stderr, "sperf: %s: recorded by sperf-%u, use that binary\n", path, hdr->abi);
+    return -1;
+  }
+  const struct trace_event *ev = (const struct trace_event *)(hdr + 1);
+  size_t n = (st.st_size - sizeof(*hdr)) / sizeof(struct trace_event);
+  madvise((void *)base, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+  for (int i = 0; i < opts.nfilter; i++)
+    wanted[opts.nrs[i]] = 1;
+  t0 = hdr->start_ns;
+  if (opts.window_ms > 0 && n > 0) {
+    uint64_t end = ev[n - 1].ts + (ev[n - 1].type == EV_SYSCALL ? ev[n - 1].dur : 0);
+    win_len = (uint64_t)opts.window_ms * 1000000;
+    nwin = end > t0 ? (end - t0) / win_len + 1 : 1;
+    if (nwin > WIN_MAX) {
+      fprintf(stderr, "sperf: more than %d windows of %d ms, use a larger -w\n", WIN_MAX, opts.window_ms);
+      return -1;
+    }
+  }
+
+  int jobs = opts.jobs > 0 ? opts.jobs : sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs > n / 4096 + 1)
+    jobs = n / 4096 + 1;                /* small files are not worth a thread */
+  struct agg *as = (struct agg *)calloc(jobs, sizeof(struct agg));
+  pthread_t tids[jobs];
+  for (int j = 0; j < jobs; j++) {
+    as[j].ev = ev + n / jobs * j;
+    as[j].n  = j == jobs - 1 ? n - n / jobs * j : n / jobs;
+    if (nwin)
+      as[j].win_nr_ns = calloc(nwin, sizeof(as[j].win_nr_ns[0]));
+    pthread_create(&tids[j], NULL, worker, &as[j]);
+  }
+  for (int j = 0; j < jobs; j++)
+    pthread_join(tids[j], NULL);
+  merge(as, jobs);
+
+  for (int j = 1; j < jobs; j++) {
+    free(as[j].tids);
+    free(as[j].tid_slot);
+    free(as[j].win_nr_ns);
+  }
+  munmap((void *)base, st.st_size);
+  return 0;
+}
+
+/* -w: calls, busy time and the top syscall of every window */
+void report_windows() {
+  if (nwin == 0)
+    return;
+  printf("\nWindow(s)\tCall\tCalls/s\t\tCost(s)\t\tTop syscall\n");
+  printf("===============================================================================================\n");
+  for (int w = 0; w < nwin; w++) {
+    int top = -1;
+    for (int nr = 0; nr < MAXSYSCALL; nr++) {
+      if (total->win_nr_ns[w][nr] && (top < 0 || total->win_nr_ns[w][nr] > total->win_nr_ns[w][top]))
+        top = nr;
+    }
+    printf("%-10.3lf\t%-8llu%-12.0lf\t%-12lf\t", \
+                                    w * win_len / 1e9, \
+                                    (unsigned long long)total->win_calls[w], \
+                                    total->win_calls[w] / (win_len / 1e9), \
+                                    total->win_ns[w] / 1e9);
+    if (top >= 0)
+      printf("%s (%.1lf%%)\n", syscall_name(top), (double)total->win_nr_ns[w][top] / total->win_ns[w] * 100);
+    else
+      printf("-\n");
+  }
+}
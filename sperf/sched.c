@@ -0,0 +1,76 @@
+#include "sperf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+static struct cpu_stat stats[MAXSYSCALL];
+
+/* time on a cpu and time runnable, ns, of a stopped thread; the file is
+ * kept open and read again from offset 0, proc regenerates it */
+static int sched_read(struct task *t, uint64_t *run, uint64_t *runq) {
+  char buf[96];
+  if (t->sched_fd == 0) {
+    snprintf(buf, sizeof(buf), "/proc/%d/schedstat", t->tid);
+    int fd = open(buf, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return -1;
+    t->sched_fd = fd + 1;
+  }
+  ssize_t n = pread(t->sched_fd - 1, buf, sizeof(buf) - 1, 0);
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+  char *end;
+  *run  = strtoull(buf, &end, 10);
+  *runq = strtoull(end, NULL, 10);
+  return 0;
+}
+
+/* syscall entry stop: closes the gap in user space since the last exit */
+void sched_enter(struct task *t, uint64_t now) {
+  uint64_t run, runq;
+  size_t n;
+  if (sched_read(t, &run, &runq) < 0) {
+    t->run_ns  = UINT64_MAX;            /* sched_exit() skips the call */
+    t->exit_ns = 0;
+    return;
+  }
+  if (t->exit_ns && t->ts) {
+    struct thread_stat *ts = &thread_stats(&n)[t->ts - 1];
+    ts->user_ns += run - t->run_ns;
+    ts->gap_ns  += now - t->exit_ns;
+  }
+  t->run_ns  = run;
+  t->runq_ns = runq;
+}
+
+/* syscall exit stop, after syscall_account() */
+void sched_exit(struct task *t, long nr, uint64_t now) {
+  uint64_t run, runq;
+  size_t n;
+  if (sched_read(t, &run, &runq) < 0 || run < t->run_ns) {
+    t->exit_ns = 0;
+    return;
+  }
+  if (nr >= 0 && nr < MAXSYSCALL) {
+    stats[nr].wall_ns += now - t->enter_ns;
+    stats[nr].cpu_ns  += run - t->run_ns;
+    stats[nr].runq_ns += runq - t->runq_ns;
+  }
+  if (t->ts)
+    thread_stats(&n)[t->ts - 1].cpu_ns += run - t->run_ns;
+  t->run_ns  = run;
+  t->runq_ns = runq;
+  t->exit_ns = now;
+}
+
+void sched_close(struct task *t) {
+  if (t->sched_fd)
+    close(t->sched_fd - 1);
+  t->sched_fd = 0;
+}
+
+struct cpu_stat *sched_stats() {
+  return stats;
+}
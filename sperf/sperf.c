@@ -1,114 +1,346 @@
+#include "sperf.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <regex.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <time.h>
+#include <sys/syscall.h>
 
-// #define LOCAL_MACHINE
-#define BUFSIZE       512
-#define MAXSYSCALL    512
-#define n_rule          2
+#define NAME_SLOTS    2048          /* name hash, power of two > MAXSTAT */
+#define MAXSTAT       (MAXSYSCALL + 64) /* numbered rows, then unknown names */
 
-#ifdef LOCAL_MACHINE
-  #define debug(...) printf(__VA_ARGS__)
-#else
-  #define debug(...) 
-#endif
+/* statistic message, row nr < MAXSYSCALL is syscall nr */
+static struct pattern {
+  char     syscall_name[32];
+  uint64_t use_ns;
+  uint64_t min_ns, max_ns;
+  size_t   call_time;
+  uint32_t hist[HIST_BUCKETS];
+} stat_mes[MAXSTAT];
+
+static int nextra = MAXSYSCALL;     /* next row for a name with no number */
+static int name_slot[NAME_SLOTS];   /* row + 1, 0 is empty */
+
+static const char *syscall_names[MAXSYSCALL] = {
+#define SYSCALL(name) [__NR_##name] = #name,
+#include "syscalls.h"
+#undef SYSCALL
+};
+
+const char *syscall_name(int nr) {
+  static char unknown[32];
+  if (nr >= 0 && nr < MAXSYSCALL && syscall_names[nr] != NULL)
+    return syscall_names[nr];
+  snprintf(unknown, sizeof(unknown), "syscall_%d", nr);
+  return unknown;
+}
 
-enum { MATCH_SUCCESS = 0, MATCH_FAILURE, MATCH_EXIST };
+uint32_t hash_name(const char *name) {
+  uint32_t h = 2166136261u;             /* FNV-1a */
+  for (; *name; name++)
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  return h;
+}
 
-void show_strace_out();
+static const char *row_name(int row) {
+  return row < MAXSYSCALL ? syscall_names[row] : stat_mes[row].syscall_name;
+}
 
-/* statistic message. */
-static struct pattern {
-  char syscall_name[32];
-  double       use_time;
-  size_t      call_time;
-} stat_mes[MAXSYSCALL];
-
-static size_t total = 0;
-
-/******************** regex expr setting **********************/
-static const char *rules[n_rule] = { "^\\w+", "<[0-9.]+>" };
-static regex_t re[n_rule];
-
-void init_regex() {
-  int ret, i;
-  char error_msg[128];
-  for (i = 0; i < n_rule; i++) {
-    ret = regcomp(&re[i], rules[i], REG_EXTENDED);
-    if (ret != 0) {
-      regerror(ret, &re[i], error_msg, 128);
-      printf("regex compilation failed: %s\n%s\n", error_msg, rules[i]);
-    }
+/* slot of `name`, or the empty slot where it goes */
+static int *name_find(const char *name) {
+  uint32_t i = hash_name(name);
+  for (;; i++) {
+    int *slot = &name_slot[i & (NAME_SLOTS - 1)];
+    if (*slot == 0 || strcmp(row_name(*slot - 1), name) == 0)
+      return slot;
   }
 }
 
-int match_regex(char *lbuf, int n) {
-  regmatch_t pmatch;
-  size_t match_idx = 0;
-  char bigram[2][32];           /* [0]: syscall name, [1]: use time */
+static void __attribute__((constructor)) init_names() {
+  for (int nr = 0; nr < MAXSYSCALL; nr++) {
+    if (syscall_names[nr])
+      *name_find(syscall_names[nr]) = nr + 1;
+  }
+}
 
-  debug("[LINE][%3d]: %s", n, lbuf);
-   
-  for (int offset = 0; offset < n; offset++) {       /* match regex */
-    int status = regexec(&re[match_idx], lbuf + offset, 1, &pmatch, 0);
+int syscall_nr(const char *name) {
+  int row = *name_find(name) - 1;
+  return row < MAXSYSCALL ? row : -1;
+}
 
-    if (status == 0 && pmatch.rm_so == 0) {
-      char *match_str_start = lbuf + offset;
-      int match_str_len = pmatch.rm_eo; 
+/* middle of the bucket's range */
+static uint64_t hist_value(int bucket) {
+  if (bucket < HIST_SUB) 
+    return bucket;
+  int e = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+  return hist_low(bucket) + ((1ull << (e - HIST_SUB_BITS)) >> 1);
+}
 
-      strncpy(bigram[match_idx], match_str_start, match_str_len);
-      bigram[match_idx][match_str_len] = '\0';
+/* one writer (the tracer), relaxed so the live view may read along */
+#define LOAD(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+static inline void row_add(struct pattern *p, uint64_t ns) {
+  int b = hist_bucket(ns);
+  STORE(p->use_ns, p->use_ns + ns);
+  STORE(p->call_time, p->call_time + 1);
+  if (ns > p->max_ns) 
+    STORE(p->max_ns, ns);
+  if (ns < p->min_ns || p->call_time == 1) 
+    STORE(p->min_ns, ns);
+  STORE(p->hist[b], p->hist[b] + 1);
+}
 
-      match_idx += 1;
-      offset    += match_str_len - 1;
-    }
-    if (match_idx == 2) break;
+/* backends that know the number: no string work at all */
+void stat_add_nr(int nr, uint64_t ns) {
+  if (nr >= 0 && nr < MAXSYSCALL) 
+    row_add(&stat_mes[nr], ns);
+  else 
+    stat_add(syscall_name(nr), ns);
+}
+
+void stat_add(const char *name, uint64_t ns) {
+  int *slot = name_find(name);
+  if (*slot == 0) {
+    if (nextra == MAXSTAT) 
+      return;
+    /* without syscall record, add a new node */
+    strncpy(stat_mes[nextra].syscall_name, name, sizeof(stat_mes[0].syscall_name) - 1);
+    *slot = nextra + 1;
+    __atomic_store_n(&nextra, nextra + 1, __ATOMIC_RELEASE);
   }
+  row_add(&stat_mes[*slot - 1], ns);
+}
 
-  if (match_idx == 1) return MATCH_EXIST;
-  debug("match bigram (%s, %s)\n", bigram[0], bigram[1]);
+/* one finished syscall of a native backend */
+void syscall_account(struct task *t, long nr, long ret, uint64_t ns) {
+  stat_add_nr(nr, ns);
+  io_done(t, thread_add(t, ns), nr, ret, ns);
+  if (opts.record) 
+    record_add(t, nr, ret, ns);
+  if (t->stack) 
+    stack_add(t->stack, ns);
+  t->stack = 0;
+}
 
-  /* insert record */
-  bigram[1][strlen(bigram[1]) - 1] = '\0';
+/* a row aggregated elsewhere (sperf report) */
+void stat_merge(int nr, uint64_t calls, uint64_t ns, uint64_t min_ns, uint64_t max_ns, const uint32_t *hist) {
+  struct pattern *p = &stat_mes[nr];
+  if (calls == 0) 
+    return;
+  if (p->call_time == 0 || min_ns < p->min_ns) 
+    p->min_ns = min_ns;
+  if (max_ns > p->max_ns) 
+    p->max_ns = max_ns;
+  p->use_ns    += ns;
+  p->call_time += calls;
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    p->hist[i] += hist[i];
+}
 
-  for (int i = 0; i < total; i++) {
-    if (strcmp(bigram[0], stat_mes[i].syscall_name) == 0) {
-      stat_mes[i].use_time  += atof(bigram[1] + 1);
-      stat_mes[i].call_time += 1;
-      return MATCH_SUCCESS;
+/* q-th quantile in ns, clamped to the exact min and max */
+static uint64_t percentile(const struct pattern *p, double q) {
+  uint64_t rank = (uint64_t)(q * LOAD(p->call_time)), seen = 0;
+  uint64_t min_ns = LOAD(p->min_ns), max_ns = LOAD(p->max_ns);
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += LOAD(p->hist[i]);
+    if (seen > rank) {
+      uint64_t v = hist_value(i);
+      return v < min_ns ? min_ns : v > max_ns ? max_ns : v;
     }
   }
-  /* without syscall record, add a new node */
-  strcpy(stat_mes[total].syscall_name, bigram[0]);
-  stat_mes[total].call_time  = 1;
-  stat_mes[total++].use_time = atof(bigram[1] + 1);
-  
-  return MATCH_SUCCESS;
+  return max_ns;
 }
 
 int cmp(const void *x, const void *y) {
-  double x_time = ((struct pattern *)x)->use_time;
-  double y_time = ((struct pattern *)y)->use_time;
-  if ((x_time - y_time) < 0) 
-    return 1;
-  else if ((x_time - y_time) == 0)
-    return 0;
-  else 
-    return -1;
+  uint64_t x_time = (*(struct pattern **)x)->use_ns;
+  uint64_t y_time = (*(struct pattern **)y)->use_ns;
+  return x_time < y_time ? 1 : x_time > y_time ? -1 : 0;
 }
 
-static void show_stat() {
-  // sort 
-  qsort(stat_mes, total, sizeof(stat_mes[0]), cmp);
+uint64_t stat_lost(uint64_t n) {
+  static uint64_t lost = 0;
+  return lost += n;
+}
+
+size_t stat_rows(struct stat_row *out) {
+  struct pattern *rows[MAXSTAT];
+  size_t total = 0;
+  for (int i = 0; i < nextra; i++) {
+    if (stat_mes[i].call_time) rows[total++] = &stat_mes[i];
+  }
+  qsort(rows, total, sizeof(rows[0]), cmp);
+  for (size_t i = 0; i < total; i++) {
+    struct pattern *p = rows[i];
+    int row = p - stat_mes;
+    if (row < MAXSYSCALL && p->syscall_name[0] == '\0')
+      strncpy(p->syscall_name, syscall_name(row), sizeof(p->syscall_name) - 1);
+    out[i] = (struct stat_row) {
+      .name   = p->syscall_name,
+      .nr     = row < MAXSYSCALL ? row : -1,
+      .calls  = p->call_time,
+      .ns     = p->use_ns,
+      .min_ns = p->min_ns,
+      .max_ns = p->max_ns,
+      .p50_ns = percentile(p, 0.50),
+      .p90_ns = percentile(p, 0.90),
+      .p99_ns = percentile(p, 0.99),
+      .hist   = p->hist,
+    };
+  }
+  return total;
+}
+
+#define SHOW_THREADS  20
+
+static int cmp_thread(const void *x, const void *y) {
+  uint64_t x_time = ((struct thread_stat *)x)->ns;
+  uint64_t y_time = ((struct thread_stat *)y)->ns;
+  return x_time < y_time ? 1 : x_time > y_time ? -1 : 0;
+}
+
+/* only worth a table when there is more than one thread */
+static void show_threads() {
+  size_t n;
+  struct thread_stat *ts = thread_stats(&n);
+  uint64_t cost_time = 0;
+  if (n < 2) 
+    return;
+
+  qsort(ts, n, sizeof(ts[0]), cmp_thread);
+  for (size_t i = 0; i < n; i++)
+    cost_time += ts[i].ns;
+  printf("\nThread\t\tComm\t\t\tCost(s)\t\tCall\tPercent(%%)\tRead(B)\t\tWritten(B)\n");
+  printf("===============================================================================================\n");
+  for (size_t i = 0; i < n && i < SHOW_THREADS; i++) {
+    printf("[%-8d]\t%-16s\t%-12lf\t%-8llu%-8.2lf\t%-12llu\t%-12llu\n", \
+                                    ts[i].tid, \
+                                    ts[i].comm, \
+                                    ts[i].ns / 1e9, \
+                                    (unsigned long long)ts[i].calls, \
+                                    cost_time ? (double)ts[i].ns / cost_time * 100 : 0, \
+                                    (unsigned long long)ts[i].bytes_in, \
+                                    (unsigned long long)ts[i].bytes_out);
+  }
+  if (n > SHOW_THREADS) 
+    printf("... %zu more threads\n", n - SHOW_THREADS);
+}
+
+#define SHOW_FILES    10
+
+static int cmp_file_time(const void *x, const void *y) {
+  uint64_t x_time = (*(struct io_file **)x)->ns;
+  uint64_t y_time = (*(struct io_file **)y)->ns;
+  return x_time < y_time ? 1 : x_time > y_time ? -1 : 0;
+}
+
+static int cmp_file_bytes(const void *x, const void *y) {
+  const struct io_file *a = *(struct io_file **)x, *b = *(struct io_file **)y;
+  uint64_t x_bytes = a->bytes_in + a->bytes_out, y_bytes = b->bytes_in + b->bytes_out;
+  return x_bytes < y_bytes ? 1 : x_bytes > y_bytes ? -1 : 0;
+}
+
+static void show_file_rows(struct io_file **fs, size_t n) {
+  for (size_t i = 0; i < n && i < SHOW_FILES; i++) {
+    const char *path = fs[i]->path;
+    size_t len = strlen(path);
+    printf("%-40s\t%-12lf\t%-8llu%-12llu\t%-12llu\n", \
+                                    len > 40 ? path + len - 40 : path, \
+                                    fs[i]->ns / 1e9, \
+                                    (unsigned long long)fs[i]->calls, \
+                                    (unsigned long long)fs[i]->bytes_in, \
+                                    (unsigned long long)fs[i]->bytes_out);
+  }
+}
+
+/* slowest and busiest files, sockets and pipes */
+static void show_files() {
+  size_t n, used = 0;
+  struct io_file *files = io_files(&n);
+  struct io_file **fs = (struct io_file **)malloc((n + 1) * sizeof(struct io_file *));
+  for (size_t i = 0; i < n; i++) {
+    if (files[i].calls) fs[used++] = &files[i];
+  }
+  if (used > 0) {
+    qsort(fs, used, sizeof(fs[0]), cmp_file_time);
+    printf("\nFile (by time)\t\t\t\t\tCost(s)\t\tCall\tRead(B)\t\tWritten(B)\n");
+    printf("===============================================================================================\n");
+    show_file_rows(fs, used);
+    qsort(fs, used, sizeof(fs[0]), cmp_file_bytes);
+    printf("\nFile (by bytes)\t\t\t\t\tCost(s)\t\tCall\tRead(B)\t\tWritten(B)\n");
+    printf("===============================================================================================\n");
+    show_file_rows(fs, used);
+  }
+  free(fs);
+}
+
+static int cmp_cpu(const void *x, const void *y) {
+  uint64_t x_time = sched_stats()[*(int *)x].wall_ns;
+  uint64_t y_time = sched_stats()[*(int *)y].wall_ns;
+  return x_time < y_time ? 1 : x_time > y_time ? -1 : 0;
+}
 
-  double cost_time = 0;
+/* -c: where the syscall time went, and what the threads did in between */
+static void show_cpu() {
+  struct cpu_stat *cs = sched_stats();
+  int nrs[MAXSYSCALL], total = 0;
+  for (int nr = 0; nr < MAXSYSCALL; nr++) {
+    if (cs[nr].wall_ns) nrs[total++] = nr;
+  }
+  if (total == 0) 
+    return;
+  qsort(nrs, total, sizeof(nrs[0]), cmp_cpu);
+  printf("\nSyscall \t\tWall(s)\t\tCPU(s)\t\tRunnable(s)\tBlocked(s)\tBlocked(%%)\n");
+  printf("===============================================================================================\n");
   for (int i = 0; i < total; i++) {
-    cost_time += stat_mes[i].use_time;
+    struct cpu_stat *c = &cs[nrs[i]];
+    uint64_t off = c->wall_ns > c->cpu_ns ? c->wall_ns - c->cpu_ns : 0;
+    uint64_t blocked = off > c->runq_ns ? off - c->runq_ns : 0;
+    printf("[%-16s]\t%-12lf\t%-12lf\t%-12lf\t%-12lf\t%-8.2lf\n", \
+                                    syscall_name(nrs[i]), \
+                                    c->wall_ns / 1e9, \
+                                    c->cpu_ns / 1e9, \
+                                    c->runq_ns / 1e9, \
+                                    blocked / 1e9, \
+                                    (double)blocked / c->wall_ns * 100);
+  }
+
+  size_t n;
+  struct thread_stat *ts = thread_stats(&n);
+  qsort(ts, n, sizeof(ts[0]), cmp_thread);
+  printf("\nThread\t\tComm\t\t\tUser(s)\t\tGap(s)\t\tSys CPU(s)\tSys wait(s)\n");
+  printf("===============================================================================================\n");
+  for (size_t i = 0; i < n && i < SHOW_THREADS; i++) {
+    printf("[%-8d]\t%-16s\t%-12lf\t%-12lf\t%-12lf\t%-12lf\n", \
+                                    ts[i].tid, \
+                                    ts[i].comm, \
+                                    ts[i].user_ns / 1e9, \
+                                    ts[i].gap_ns / 1e9, \
+                                    ts[i].cpu_ns / 1e9, \
+                                    ts[i].ns > ts[i].cpu_ns ? (ts[i].ns - ts[i].cpu_ns) / 1e9 : 0);
+  }
+  if (n > SHOW_THREADS) 
+    printf("... %zu more threads\n", n - SHOW_THREADS);
+}
+
+static void show_stat() {
+  struct pattern *rows[MAXSTAT];
+  size_t total = 0;
+  uint64_t cost_time = 0;
+  for (int i = 0; i < nextra; i++) {
+    if (stat_mes[i].call_time == 0) continue;
+    if (i < MAXSYSCALL && stat_mes[i].syscall_name[0] == '\0')
+      strncpy(stat_mes[i].syscall_name, syscall_name(i), sizeof(stat_mes[0].syscall_name) - 1);
+    rows[total++] = &stat_mes[i];
+    cost_time += stat_mes[i].use_ns;
   }
 
+  // sort 
+  qsort(rows, total, sizeof(rows[0]), cmp);
+
   static size_t flag = 0;
   static size_t pre_total = 0;
   if (flag++ != 0) {
@@ -116,16 +348,159 @@ static void show_stat() {
   }
 
   // show
-  printf("Syscall \t\tCost(s)\t\tCall\tPercent(%%)\n");
-  printf("===========================================================\n");
+  printf("Syscall \t\tCost(s)\t\tCall\tPercent(%%)\tp50(us)\t\tp90(us)\t\tp99(us)\t\tmax(us)\n");
+  printf("===============================================================================================================\n");
   for (int i = 0; i < total; i++) {
-    printf("[%-16s]\t%-12lf\t%-8zu%-8.2lf\n", \
-                                    stat_mes[i].syscall_name, \
-                                    stat_mes[i].use_time, \
-                                    stat_mes[i].call_time, \
-                                    (stat_mes[i].use_time / cost_time) * 100);
+    struct pattern *p = rows[i];
+    printf("[%-16s]\t%-12lf\t%-8zu%-8.2lf\t%-12.3lf\t%-12.3lf\t%-12.3lf\t%-12.3lf\n", \
+                                    p->syscall_name, \
+                                    p->use_ns / 1e9, \
+                                    p->call_time, \
+                                    cost_time ? (double)p->use_ns / cost_time * 100 : 0, \
+                                    percentile(p, 0.50) / 1e3, \
+                                    percentile(p, 0.90) / 1e3, \
+                                    percentile(p, 0.99) / 1e3, \
+                                    p->max_ns / 1e3);
   }
   pre_total = total;
+  show_threads();
+  show_files();
+  if (opts.cpu) 
+    show_cpu();
+}
+
+/* live view (-i): a display thread redraws every interval from relaxed
+ * reads of stat_mes, the tracer never waits for the terminal */
+enum { SORT_TIME, SORT_CALLS, SORT_TOTAL, SORT_P99, SORT_MAX, SORT_NAME };
+static const char *sort_keys[] = { "time", "calls", "total", "p99", "max", "name" };
+
+struct live_row {
+  char     name[32];
+  uint64_t use_ns, calls, max_ns, p99_ns;
+  uint64_t d_ns, d_calls;               /* last interval */
+};
+
+static struct {
+  uint64_t use_ns, calls;
+} live_prev[MAXSTAT];
+
+static pthread_t       live_thread;
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  live_cond;
+static int             live_stop = 0;
+static int             sort_key = SORT_TIME;
+
+static int cmp_live(const void *x, const void *y) {
+  const struct live_row *a = x, *b = y;
+  uint64_t va, vb;
+  switch (sort_key) {
+    case SORT_NAME:  return strcmp(a->name, b->name);
+    case SORT_CALLS: va = a->d_calls, vb = b->d_calls; break;
+    case SORT_TOTAL: va = a->use_ns,  vb = b->use_ns;  break;
+    case SORT_P99:   va = a->p99_ns,  vb = b->p99_ns;  break;
+    case SORT_MAX:   va = a->max_ns,  vb = b->max_ns;  break;
+    default:         va = a->d_ns,    vb = b->d_ns;    break;
+  }
+  if (va == vb && sort_key != SORT_TOTAL)
+    va = a->use_ns, vb = b->use_ns;
+  return va < vb ? 1 : va > vb ? -1 : 0;
+}
+
+static void show_live(uint64_t elapsed_ns, uint64_t dt_ns) {
+  static struct live_row rows[MAXSTAT];
+  static char out[MAXSTAT * 160 + 512];
+  int n = 0, nrow = __atomic_load_n(&nextra, __ATOMIC_ACQUIRE);
+  uint64_t d_total = 0;
+  double dt = dt_ns / 1e9;
+
+  for (int i = 0; i < nrow; i++) {
+    struct pattern *p = &stat_mes[i];
+    uint64_t calls = LOAD(p->call_time);
+    if (calls == 0) continue;
+    struct live_row *r = &rows[n++];
+    if (i < MAXSYSCALL && syscall_names[i]) 
+      snprintf(r->name, sizeof(r->name), "%s", syscall_names[i]);
+    else if (i < MAXSYSCALL) 
+      snprintf(r->name, sizeof(r->name), "syscall_%d", i);
+    else 
+      snprintf(r->name, sizeof(r->name), "%s", p->syscall_name);
+    r->use_ns  = LOAD(p->use_ns);
+    r->calls   = calls;
+    r->max_ns  = LOAD(p->max_ns);
+    r->p99_ns  = percentile(p, 0.99);
+    r->d_ns    = r->use_ns - live_prev[i].use_ns;
+    r->d_calls = r->calls - live_prev[i].calls;
+    live_prev[i].use_ns = r->use_ns;
+    live_prev[i].calls  = r->calls;
+    d_total += r->d_ns;
+  }
+  qsort(rows, n, sizeof(rows[0]), cmp_live);
+
+  size_t len = 0;
+  len += snprintf(out + len, sizeof(out) - len,
+                  "\033[H\033[2Jsperf  %.1fs elapsed, %d syscalls, sorted by %s\n\n"
+                  "%-18s %10s %10s %7s | %10s %12s %10s %10s\n",
+                  elapsed_ns / 1e9, n, sort_keys[sort_key],
+                  "Syscall", "Calls/s", "Time/s", "Share%",
+                  "Calls", "Cost(s)", "p99(us)", "max(us)");
+  for (int i = 0; i < n; i++) {
+    struct live_row *r = &rows[i];
+    len += snprintf(out + len, sizeof(out) - len,
+                    "%-18s %10.0lf %10.6lf %7.2lf | %10llu %12.6lf %10.3lf %10.3lf\n",
+                    r->name, r->d_calls / dt, r->d_ns / 1e9 / dt,
+                    d_total ? (double)r->d_ns / d_total * 100 : 0,
+                    (unsigned long long)r->calls, r->use_ns / 1e9,
+                    r->p99_ns / 1e3, r->max_ns / 1e3);
+  }
+  fwrite(out, 1, len, stdout);
+  fflush(stdout);
+}
+
+static void *live_main(void *arg) {
+  uint64_t interval = (uint64_t)opts.interval_ms * 1000000;
+  uint64_t start = now_ns(), last = start;
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  pthread_mutex_lock(&live_lock);
+  while (!live_stop) {
+    deadline.tv_nsec += interval % 1000000000;
+    deadline.tv_sec  += interval / 1000000000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while (!live_stop && pthread_cond_timedwait(&live_cond, &live_lock, &deadline) == 0) ;
+    if (live_stop) break;
+
+    pthread_mutex_unlock(&live_lock);
+    uint64_t now = now_ns();
+    show_live(now - start, now - last);
+    last = now;
+    pthread_mutex_lock(&live_lock);
+  }
+  pthread_mutex_unlock(&live_lock);
+  return NULL;
+}
+
+/* signals stay with the tracing thread */
+static void live_start() {
+  pthread_condattr_t attr;
+  sigset_t all, old;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&live_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_create(&live_thread, NULL, live_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void live_end() {
+  pthread_mutex_lock(&live_lock);
+  live_stop = 1;
+  pthread_cond_signal(&live_cond);
+  pthread_mutex_unlock(&live_lock);
+  pthread_join(live_thread, NULL);
 }
 
 void show_args(int argc, char *argv[]) {
@@ -136,82 +511,193 @@ void show_args(int argc, char *argv[]) {
 }
 
 
-int main(int argc, char *argv[]) {
-  int pipefd[2];      /* 0 is read end and 1 is write end */
-  pid_t pid;
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [record] [options] command [args ...]\n"
+                  "       %s [record] [options] -a | -G cgroup | -p pid [command ...]\n"
+                  "       %s report [-e list] [-j threads] [-w ms] [-x file] file\n"
+                  "       %s diff [-e list] [-t percent] [-m ms] a.json b.json\n"
+                  "  -b backend   ptrace (default), perf, strace or preload\n"
+                  "               (LD_PRELOAD sperf-preload.so, libc calls only)\n"
+                  "  -S           same as -b strace\n"
+                  "  -F file      parse a strace -T [-f] log instead, '-' is stdin\n"
+                  "  -e list      only trace these syscalls, e.g. read,write\n"
+                  "  -i ms        live view, redraw every ms milliseconds\n"
+                  "  -s key       live view order: time (last interval, default),\n"
+                  "               calls, total, p99, max or name\n"
+                  "  -c           split syscall time into on-CPU, runnable and\n"
+                  "               blocked, and show user time between syscalls (ptrace)\n"
+                  "  -a           whole system (perf)\n"
+                  "  -G cgroup    processes in this cgroup directory (perf)\n"
+                  "  -p pid       attach to a running process and its threads,\n"
+                  "               Ctrl-C detaches (ptrace, or -b perf)\n"
+                  "  -g file      folded call stacks of the syscalls to file, '-' is\n"
+                  "               stdout, for flamegraph.pl (ptrace, frame pointers)\n"
+                  "  -o file      record: events to file (default sperf.bin)\n"
+                  "  -j threads   report: analysis threads (default one per cpu)\n"
+                  "  -w ms        report: also break the run into ms windows\n"
+                  "  -x file      also write the tables to file as JSON, or CSV\n"
+                  "               if it ends in .csv, '-' is stdout\n"
+                  "  -t percent   diff: smallest relative change (default 10)\n"
+                  "  -m ms        diff: smallest change of a total time (default 1);\n"
+                  "               exit status 1 if b regressed\n", prog, prog, prog, prog);
+  exit(EXIT_FAILURE);
+}
+
+/* "read,write,..." -> syscall numbers */
+static int parse_filter(const char *list, int *nrs) {
+  int n = 0;
+  char *copy = strdup(list), *save = NULL;
+  for (char *name = strtok_r(copy, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+    int nr = syscall_nr(name);
+    if (nr < 0) {
+      fprintf(stderr, "sperf: unknown syscall '%s'\n", name);
+      exit(EXIT_FAILURE);
+    }
+    int dup = 0;
+    for (int i = 0; i < n && !dup; i++)
+      dup = nrs[i] == nr;
+    if (!dup && n < MAXSYSCALL)         /* opts.nrs holds MAXSYSCALL */
+      nrs[n++] = nr;
+  }
+  free(copy);
+  return n;
+}
+
+struct options opts;
 
-  if (pipe(pipefd) == -1) {   /* create a pipe like shell */
-    perror("pipe");
+int main(int argc, char *argv[]) {
+  int opt;
+  const char *backend = NULL, *cmd = NULL;
+
+  if (argc > 1 && (strcmp(argv[1], "record") == 0 || strcmp(argv[1], "report") == 0 ||
+                   strcmp(argv[1], "diff") == 0)) {
+    cmd = argv[1];
+    argv[1] = argv[0];
+    argv++, argc--;
+  }
+  while ((opt = getopt(argc, argv, "+b:Se:acG:p:F:i:s:o:j:w:g:x:t:m:")) != -1) {
+    switch (opt) {
+      case 'b': backend = optarg; break;
+      case 'S': backend = "strace"; break;
+      case 'e': opts.filter = optarg; break;
+      case 'a': opts.all = 1; break;
+      case 'c': opts.cpu = 1; break;
+      case 'G': opts.cgroup = optarg; break;
+      case 'p': opts.pid = atoi(optarg); break;
+      case 'F': opts.input = optarg; backend = "strace"; break;
+      case 'i': opts.interval_ms = atoi(optarg); break;
+      case 'o': opts.record = optarg; break;
+      case 'g': opts.stacks = optarg; break;
+      case 'j': opts.jobs = atoi(optarg); break;
+      case 'w': opts.window_ms = atoi(optarg); break;
+      case 'x': opts.export = optarg; break;
+      case 't': opts.threshold = atof(optarg); break;
+      case 'm': opts.min_ms = atof(optarg); break;
+      case 's': 
+        for (sort_key = 0; sort_key < sizeof(sort_keys) / sizeof(sort_keys[0]); sort_key++) {
+          if (strcmp(optarg, sort_keys[sort_key]) == 0) break;
+        }
+        if (sort_key == sizeof(sort_keys) / sizeof(sort_keys[0])) 
+          usage(argv[0]);
+        break;
+      default:  usage(argv[0]);
+    }
+  }
+  if (optind < argc) {
+    opts.argc = argc - optind;
+    opts.argv = argv + optind;
+  }
+  if (opts.filter) 
+    opts.nfilter = parse_filter(opts.filter, opts.nrs);
+
+  if (cmd && strcmp(cmd, "diff") == 0) {
+    if (opts.argc != 2) 
+      usage(argv[0]);
+    if (opts.threshold <= 0) 
+      opts.threshold = 10;
+    if (opts.min_ms <= 0) 
+      opts.min_ms = 1;
+    int regressed = diff_runs(opts.argv[0], opts.argv[1]);
+    return regressed < 0 ? 2 : regressed;
+  }
+  if (cmd && strcmp(cmd, "report") == 0) {
+    if (opts.argc != 1) 
+      usage(argv[0]);
+    if (report(opts.argv[0]) < 0) 
+      exit(EXIT_FAILURE);
+    show_stat();
+    report_windows();
+    if (opts.export && export_stat(opts.export) < 0) 
+      perror(opts.export);
+    return 0;
+  }
+  if (cmd && opts.record == NULL) 
+    opts.record = "sperf.bin";
+  if (opts.record && (cmd == NULL || (backend && strcmp(backend, "strace") == 0))) 
+    usage(argv[0]);
+
+  int system = opts.all || opts.cgroup;
+  int attach = system || opts.pid;
+  if (backend == NULL) 
+    backend = system ? "perf" : "ptrace";
+  if (!opts.argv && !attach && !opts.input) 
+    usage(argv[0]);
+  if ((system && strcmp(backend, "perf") != 0) || (opts.pid && strcmp(backend, "strace") == 0)) 
+    usage(argv[0]);
+  if (opts.pid && !system && strcmp(backend, "ptrace") == 0 && opts.argv) 
+    usage(argv[0]);
+  if (opts.cpu && strcmp(backend, "ptrace") != 0) 
+    usage(argv[0]);
+  if (strcmp(backend, "preload") == 0 && (attach || opts.record || opts.stacks || !opts.argv)) 
+    usage(argv[0]);
+
+  if (opts.pid && kill(opts.pid, 0) < 0 && errno == ESRCH) {
+    fprintf(stderr, "sperf: no process %d\n", opts.pid);
     exit(EXIT_FAILURE);
   }
-  debug("hold file descriptor: (%d, %d)\n", pipefd[0], pipefd[1]);
-  
-  if ((pid = fork()) < 0 ) {  
-    perror("fork");
+  if (opts.record && record_open(opts.record) < 0) {
+    perror(opts.record);
     exit(EXIT_FAILURE);
-  } 
-
-  if (pid == 0) {                        /* child process */
-    char *exec_argv[argc + 2];
-    char *exec_envp[] = { "PATH=/bin", NULL, };
-
-    exec_argv[0] = "strace";
-    exec_argv[1] = "-T";
-    for (int idx = 1; idx < argc; idx++)
-      exec_argv[idx + 1] = argv[idx];
-    exec_argv[argc + 1] = NULL;
-
-    // show_args(argc + 2, exec_argv); 
-
-    close(pipefd[0]);                      /* redirection */
-    dup2(pipefd[1], STDERR_FILENO);
-    close(pipefd[1]);
-
-    execve("/bin/strace", exec_argv, exec_envp);
-    
-  } else {                              /* parent process */ 
-    close(pipefd[1]); 
-    dup2(pipefd[0], STDIN_FILENO);
-    close(pipefd[0]);
-
-    char buf[BUFSIZ];
-    int n, ret;
-    clock_t before;
-
-    init_regex();             /* compile regex expression */
-
-// refresh: 
-//     before = clock();
-    
-    while((n = read(0, buf, BUFSIZ)) > 0) {
-      // write(STDOUT_FILENO, buf, n);
-      while (*(buf + n - 1) != '\n' && n > 0) {
-        n += read(0, buf + n, BUFSIZ - n);
-      }
-      *(buf + n) = '\0';
-
-      match_regex(buf, n);     /* parse */ 
-
-      // clock_t difference = clock() - before;
-      // int mesc = difference * 1000 / CLOCKS_PER_SEC;
-      // if (mesc > 1) { 
-      //   show_stat();
-      //   goto refresh;
-      // }
+  }
+  if (opts.interval_ms > 0) 
+    live_start();
+
+  if (strcmp(backend, "preload") == 0 && trace_preload() < 0) {
+    fprintf(stderr, "sperf: falling back to ptrace\n");
+    backend = "ptrace";
+  }
+  if (strcmp(backend, "perf") == 0 && trace_perf() < 0) {
+    if (attach) 
+      exit(EXIT_FAILURE);
+    fprintf(stderr, "sperf: falling back to ptrace\n");
+    backend = "ptrace";
+  }
+  if (strcmp(backend, "ptrace") == 0 && trace_ptrace() < 0) {
+    if (opts.pid) {
+      fprintf(stderr, "sperf: cannot attach to %d, falling back to perf\n", opts.pid);
+      if (trace_perf() < 0) 
+        exit(EXIT_FAILURE);
+    } else if (opts.record) {
+      fprintf(stderr, "sperf: ptrace not permitted, cannot record\n");
+      exit(EXIT_FAILURE);
+    } else {
+      fprintf(stderr, "sperf: ptrace not permitted, falling back to strace\n");
+      backend = "strace";
     }
+  }
+  if (strcmp(backend, "strace") == 0) {
+    trace_strace();
+  }
 
+  if (opts.interval_ms > 0) 
+    live_end();
+  if (opts.stacks && stack_dump(opts.stacks) < 0) 
+    perror(opts.stacks);
+  if (opts.export && export_stat(opts.export) < 0) 
+    perror(opts.export);
+  if (opts.record) 
+    record_close();
+  else 
     show_stat();
-  } 
-  
   return 0;
 }
-
-// int main(int argc, char *argv[]) {
-//   char *exec_argv[] = { "strace", "ls", NULL, };
-//   char *exec_envp[] = { "PATH=/bin", NULL, };
-//   execve("strace",          exec_argv, exec_envp);
-//   execve("/bin/strace",     exec_argv, exec_envp);
-//   execve("/usr/bin/strace", exec_argv, exec_envp);
-//   perror(argv[0]);
-//   exit(EXIT_FAILURE);
-// }
\ No newline at end of file
@@ -0,0 +1,198 @@
+#ifndef _SPERF_H_
+#define _SPERF_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// #define LOCAL_MACHINE
+#define MAXSYSCALL    512
+
+#ifdef LOCAL_MACHINE
+  #define debug(...) printf(__VA_ARGS__)
+#else
+  #define debug(...)
+#endif
+
+/* traced thread (task.c) */
+struct task {
+  pid_t    tid;                 /* 0 is empty, -1 is deleted    */
+  int      fresh;               /* initial SIGSTOP not seen yet */
+  int      resume;              /* PTRACE_SYSCALL or PTRACE_CONT */
+  int      in_syscall;
+  int      seccomp;             /* entered at a seccomp stop, no syscall stop since */
+  long     nr;
+  uint64_t enter_ns;
+  uint64_t args[2];             /* at entry, for io_done()      */
+  pid_t    tgid;                /* 0 if not known yet           */
+  size_t   stack;               /* stack_capture() at entry, 0 if none */
+  size_t   ts;                  /* thread_stat + 1, 0 if none yet */
+  int      sched_fd;            /* /proc/TID/schedstat + 1, 0 if not open */
+  uint64_t run_ns, runq_ns;     /* schedstat at the last syscall stop   */
+  uint64_t exit_ns;             /* last syscall exit, 0 if none yet     */
+};
+
+struct thread_stat {
+  pid_t    tid;
+  char     comm[16];
+  uint64_t calls, ns;
+  uint64_t bytes_in, bytes_out;
+  uint64_t cpu_ns;              /* -c: on CPU inside syscalls           */
+  uint64_t user_ns, gap_ns;     /* -c: on CPU and wall between syscalls */
+};
+
+uint64_t     now_ns();
+struct task *task_find(pid_t tid, int create);
+void         task_del(struct task *t);
+size_t       task_count();
+void         task_each(void (*fn)(struct task *));
+pid_t        task_tgid(struct task *t);
+struct thread_stat *thread_add(struct task *t, uint64_t ns);
+void         thread_exec(struct task *t);
+struct thread_stat *thread_stats(size_t *n);
+struct thread_stat *thread_put(pid_t tid, const char *comm);
+
+/* I/O by file, socket or pipe (io.c) */
+#define IO_DIR_IN     1
+#define IO_DIR_OUT    2
+
+struct io_file {
+  char    *path;                /* as in /proc/PID/fd, or "fd N of PID" */
+  uint64_t calls, ns;
+  uint64_t bytes_in, bytes_out;
+};
+
+void            io_done(struct task *t, struct thread_stat *ts, long nr, long ret, uint64_t ns);
+int             io_fd(long nr, const uint64_t *args, long ret);   /* -1 if none */
+int             io_dir(long nr);    /* IO_DIR_IN, IO_DIR_OUT or 0 */
+struct io_file *io_files(size_t *n);
+
+/* on-CPU vs. off-CPU split of syscall time from /proc schedstat, -c
+ * (sched.c); runnable is waiting for a CPU, the rest of off-CPU is blocked */
+struct cpu_stat {
+  uint64_t wall_ns, cpu_ns, runq_ns;
+};
+
+void   sched_enter(struct task *t, uint64_t now);
+void   sched_exit(struct task *t, long nr, uint64_t now);
+void   sched_close(struct task *t);
+struct cpu_stat *sched_stats();     /* by syscall nr, MAXSYSCALL rows */
+
+/* Latency histogram, log-linear: HIST_SUB linear buckets per power of two
+ * of nanoseconds, so every bucket is within 1/HIST_SUB of its values. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP  40            /* 2^40 ns, longer calls share the top bucket */
+#define HIST_BUCKETS  ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+static inline int hist_bucket(uint64_t ns) {
+  if (ns < HIST_SUB) 
+    return ns;
+  int e = 63 - __builtin_clzll(ns);
+  if (e > HIST_MAX_EXP) 
+    return HIST_BUCKETS - 1;
+  return (e - HIST_SUB_BITS + 1) * HIST_SUB + (ns >> (e - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+/* smallest ns that falls in bucket */
+static inline uint64_t hist_low(int bucket) {
+  if (bucket < HIST_SUB) 
+    return bucket;
+  int e = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+  return (uint64_t)(bucket % HIST_SUB + HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+/* statistic table (sperf.c) */
+uint32_t    hash_name(const char *name);
+const char *syscall_name(int nr);
+int         syscall_nr(const char *name);   /* -1 if unknown */
+void        stat_add(const char *name, uint64_t ns);
+void        stat_add_nr(int nr, uint64_t ns);
+void        stat_merge(int nr, uint64_t calls, uint64_t ns, uint64_t min_ns, uint64_t max_ns, const uint32_t *hist);
+void        syscall_account(struct task *t, long nr, long ret, uint64_t ns);
+
+struct stat_row {
+  const char     *name;
+  int             nr;               /* -1 for a name with no number */
+  uint64_t        calls, ns, min_ns, max_ns;
+  uint64_t        p50_ns, p90_ns, p99_ns;
+  const uint32_t *hist;             /* HIST_BUCKETS */
+};
+
+size_t      stat_rows(struct stat_row *rows);   /* rows with calls, costliest first, MAXSYSCALL + 64 at most */
+uint64_t    stat_lost(uint64_t n);      /* events a backend dropped, adds n, returns the sum */
+
+/* machine-readable output and run comparison (export.c) */
+int  export_stat(const char *path);   /* JSON, or CSV for *.csv */
+int  diff_runs(const char *a, const char *b);   /* 1 if b regressed, -1 on error */
+
+/* call stacks at syscall entry, folded output (stack.c) */
+size_t stack_capture(struct task *t, long nr);
+void   stack_add(size_t id, uint64_t ns);
+void   stack_exec(struct task *t);
+int    stack_dump(const char *path);
+
+/* sperf record / report file: a header, then fixed-size events in the
+ * order the syscalls finished (record.c, report.c) */
+#define TRACE_MAGIC   "SPERFREC"
+#define TRACE_VERSION 1
+
+struct trace_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t event_size;
+  uint32_t abi;                 /* 64 or 32, the syscall numbering      */
+  uint32_t reserved;
+  uint64_t start_ns;            /* CLOCK_MONOTONIC                      */
+};
+
+enum { EV_SYSCALL = 0, EV_COMM };
+
+struct trace_event {
+  uint64_t ts;                  /* syscall entry, CLOCK_MONOTONIC ns    */
+  uint64_t dur;                 /* ns; EV_COMM: comm[0..7]              */
+  int64_t  ret;                 /* EV_COMM: comm[8..15]                 */
+  int32_t  tid;
+  int32_t  nr;
+  int32_t  fd;                  /* -1 if the syscall takes none         */
+  uint32_t type;
+};
+
+int  record_open(const char *path);
+void record_add(struct task *t, long nr, long ret, uint64_t ns);
+void record_comm(pid_t tid, const char *comm);
+void record_close();
+int  report(const char *path);
+void report_windows();
+
+/* command line (sperf.c) */
+struct options {
+  int         argc;             /* command to run, argv is NULL if none */
+  char      **argv;
+  const char *filter;           /* -e list as given                     */
+  int         nrs[MAXSYSCALL];  /* -e list as syscall numbers           */
+  int         nfilter;
+  pid_t       pid;              /* -p, ptrace attach or perf            */
+  const char *cgroup;           /* -G                                   */
+  int         all;              /* -a                                   */
+  const char *input;            /* -F, strace -T log to parse           */
+  int         interval_ms;      /* -i, live view refresh, 0 is off      */
+  const char *record;           /* record -o, trace file to write       */
+  const char *stacks;           /* -g, folded call stacks to write      */
+  int         jobs;             /* report -j, threads, 0 is one per cpu */
+  int         window_ms;        /* report -w, time window, 0 is off     */
+  int         cpu;              /* -c, on-CPU vs. blocked split         */
+  const char *export;           /* -x, JSON or CSV of the tables        */
+  double      threshold;        /* diff -t, relative change, percent    */
+  double      min_ms;           /* diff -m, smallest total change, ms   */
+};
+
+extern struct options opts;
+
+/* tracing backends, trace `opts` to the end and feed stat_add() and
+ * thread_add(), -1 if the backend is not permitted here */
+int trace_ptrace();
+int trace_perf();
+int trace_strace();
+int trace_preload();
+
+#endif /* end of "sperf.h" */
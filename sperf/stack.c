@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include "sperf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+
+#define STACK_DEPTH   32
+#define STACK_WINDOW  16384         /* bytes read from sp in one go */
+
+/* A stack is kept as interned symbol names, resolved while the process
+ * is still there: stacks from different processes (and ASLR layouts)
+ * of the same code fold into one. */
+struct stack {
+  int      nr, depth;
+  uint32_t comm;
+  uint32_t frames[STACK_DEPTH];   /* outermost first */
+  uint64_t calls, ns;
+};
+
+struct sym {
+  uintptr_t   addr, size;
+  const char *name;
+};
+
+/* an executable file, its symbols sorted by address */
+struct elf {
+  char       *path;
+  const char *base;
+  size_t      size;
+  const ElfW(Phdr) *phdr;
+  int         nphdr;
+  struct sym *syms;
+  size_t      nsym;
+};
+
+struct map {
+  uintptr_t    start, end, offset;
+  struct elf  *elf;               /* NULL for [vdso] and anonymous code */
+  const char  *name;
+};
+
+/* one process image, replaced on exec */
+struct image {
+  pid_t       tgid;
+  int         gen;
+  uint32_t    comm;
+  struct map *maps;
+  int         nmap;
+};
+
+static char   **names = NULL;           /* interned strings */
+static size_t   nname = 0, name_cap = 0;
+static uint32_t *name_slot = NULL;      /* name + 1 */
+static size_t   name_slots = 0;
+
+static struct stack *stacks = NULL;
+static size_t   nstack = 0, stack_cap = 0;
+static uint32_t *stack_slot = NULL;     /* stack + 1 */
+static size_t   stack_slots = 0;
+
+static struct {                         /* (tgid, gen, pc) -> name */
+  pid_t     tgid;
+  int       gen;
+  uintptr_t pc;
+  uint32_t  name;
+} *pcs = NULL;
+static size_t npc = 0, pc_cap = 0;
+
+static struct elf   **elfs = NULL;
+static size_t         nelf = 0;
+static struct image  *images = NULL;
+static size_t         nimage = 0;
+
+static uint32_t intern(const char *s) {
+  if ((nname + 1) * 2 > name_slots) {
+    free(name_slot);
+    name_slots = name_slots ? name_slots * 2 : 1024;
+    name_slot = (uint32_t *)calloc(name_slots, sizeof(uint32_t));
+    for (size_t i = 0; i < nname; i++) {
+      size_t h = hash_name(names[i]);
+      while (name_slot[h & (name_slots - 1)]) h++;
+      name_slot[h & (name_slots - 1)] = i + 1;
+    }
+  }
+  size_t h = hash_name(s);
+  for (;; h++) {
+    uint32_t *slot = &name_slot[h & (name_slots - 1)];
+    if (*slot == 0) {
+      if (nname == name_cap) {
+        name_cap = name_cap ? name_cap * 2 : 1024;
+        names = (char **)realloc(names, name_cap * sizeof(char *));
+      }
+      names[nname] = strdup(s);
+      *slot = ++nname;
+      return nname - 1;
+    }
+    if (strcmp(names[*slot - 1], s) == 0)
+      return *slot - 1;
+  }
+}
+
+static int cmp_sym(const void *x, const void *y) {
+  uintptr_t a = ((struct sym *)x)->addr, b = ((struct sym *)y)->addr;
+  return a < b ? -1 : a > b;
+}
+
+/* .symtab and .dynsym functions; a file that is not ELF has none */
+static struct elf *elf_load(const char *path) {
+  for (size_t i = 0; i < nelf; i++) {
+    if (strcmp(elfs[i]->path, path) == 0)
+      return elfs[i];
+  }
+  struct elf *e = (struct elf *)calloc(1, sizeof(struct elf));
+  e->path = strdup(path);
+  elfs = (struct elf **)realloc(elfs, (nelf + 1) * sizeof(struct elf *));
+  elfs[nelf++] = e;
+
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof(ElfW(Ehdr))) {
+    if (fd >= 0) close(fd);
+    return e;
+  }
+  const char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return e;
+  const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *)base;
+  size_t size = st.st_size;
+  if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != (sizeof(long) == 8 ? ELFCLASS64 : ELFCLASS32) ||
+      eh->e_phoff + eh->e_phnum * sizeof(ElfW(Phdr)) > size || eh->e_shoff + eh->e_shnum * sizeof(ElfW(Shdr)) > size) {
+    munmap((void *)base, size);
+    return e;
+  }
+  e->base  = base;
+  e->size  = size;
+  e->phdr  = (const ElfW(Phdr) *)(base + eh->e_phoff);
+  e->nphdr = eh->e_phnum;
+
+  const ElfW(Shdr) *sh = (const ElfW(Shdr) *)(base + eh->e_shoff);
+  size_t cap = 0;
+  for (int i = 0; i < eh->e_shnum; i++) {
+    if (sh[i].sh_type != SHT_SYMTAB && sh[i].sh_type != SHT_DYNSYM) continue;
+    if (sh[i].sh_link >= eh->e_shnum) continue;
+    const ElfW(Shdr) *str = &sh[sh[i].sh_link];
+    if (sh[i].sh_offset + sh[i].sh_size > size || str->sh_offset + str->sh_size > size) continue;
+    const ElfW(Sym) *sym = (const ElfW(Sym) *)(base + sh[i].sh_offset);
+    size_t n = sh[i].sh_size / sizeof(ElfW(Sym));
+    for (size_t j = 0; j < n; j++) {
+      if (ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC || sym[j].st_value == 0 ||
+          sym[j].st_shndx == SHN_UNDEF || sym[j].st_name >= str->sh_size) continue;
+      if (e->nsym == cap) {
+        cap = cap ? cap * 2 : 1024;
+        e->syms = (struct sym *)realloc(e->syms, cap * sizeof(struct sym));
+      }
+      e->syms[e->nsym].addr = sym[j].st_value;
+      e->syms[e->nsym].size = sym[j].st_size;
+      e->syms[e->nsym].name = base + str->sh_offset + sym[j].st_name;
+      e->nsym++;
+    }
+  }
+  qsort(e->syms, e->nsym, sizeof(struct sym), cmp_sym);
+  return e;
+}
+
+/* executable mappings of the process, from /proc/PID/maps */
+static void image_load(struct image *im) {
+  char path[64], line[4096];
+  free(im->maps);
+  im->maps = NULL, im->nmap = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/comm", im->tgid);
+  FILE *fp = fopen(path, "r");
+  if (fp && fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\n")] = '\0';
+    im->comm = intern(line);
+  } else {
+    im->comm = intern("?");
+  }
+  if (fp) fclose(fp);
+
+  snprintf(path, sizeof(path), "/proc/%d/maps", im->tgid);
+  if ((fp = fopen(path, "r")) == NULL)
+    return;
+  int cap = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    unsigned long start, end, offset;
+    char perms[8];
+    int name_at = 0;
+    if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms, &offset, &name_at) < 4 || perms[2] != 'x')
+      continue;
+    char *name = line + name_at;
+    name[strcspn(name, "\n")] = '\0';
+    if (im->nmap == cap) {
+      cap = cap ? cap * 2 : 32;
+      im->maps = (struct map *)realloc(im->maps, cap * sizeof(struct map));
+    }
+    struct map *m = &im->maps[im->nmap++];
+    m->start  = start;
+    m->end    = end;
+    m->offset = offset;
+    m->elf    = name[0] == '/' ? elf_load(name) : NULL;
+    m->name   = names[intern(name[0] ? name : "[anon]")];
+  }
+  fclose(fp);
+}
+
+static struct image *image_of(pid_t tgid) {
+  for (size_t i = 0; i < nimage; i++) {
+    if (images[i].tgid == tgid)
+      return &images[i];
+  }
+  images = (struct image *)realloc(images, (nimage + 1) * sizeof(struct image));
+  struct image *im = &images[nimage++];
+  memset(im, 0, sizeof(*im));
+  im->tgid = tgid;
+  image_load(im);
+  return im;
+}
+
+static struct map *map_find(struct image *im, uintptr_t pc) {
+  for (int i = 0; i < im->nmap; i++) {
+    if (pc >= im->maps[i].start && pc < im->maps[i].end)
+      return &im->maps[i];
+  }
+  return NULL;
+}
+
+/* "function", or "file+0xoffset" without symbols */
+static uint32_t symbolize(struct image *im, uintptr_t pc) {
+  char buf[512];
+  struct map *m = map_find(im, pc);
+  if (m == NULL) {
+    image_load(im);                     /* dlopen since the last look */
+    if ((m = map_find(im, pc)) == NULL)
+      return intern("[unknown]");
+  }
+  const char *file = strrchr(m->name, '/') ? strrchr(m->name, '/') + 1 : m->name;
+  uintptr_t off = pc - m->start + m->offset;
+  struct elf *e = m->elf;
+  if (e && e->base) {
+    for (int i = 0; i < e->nphdr; i++) {
+      const ElfW(Phdr) *ph = &e->phdr[i];
+      if (ph->p_type != PT_LOAD || off < ph->p_offset || off >= ph->p_offset + ph->p_filesz) continue;
+      uintptr_t vaddr = off - ph->p_offset + ph->p_vaddr;
+      size_t lo = 0, hi = e->nsym;      /* last symbol at or below vaddr */
+      while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (e->syms[mid].addr <= vaddr) lo = mid + 1;
+        else hi = mid;
+      }
+      if (lo > 0) {
+        struct sym *s = &e->syms[lo - 1];
+        if (vaddr < s->addr + s->size || (s->size == 0 && (lo == e->nsym || vaddr < e->syms[lo].addr)))
+          return intern(s->name);
+      }
+      break;
+    }
+  }
+  snprintf(buf, sizeof(buf), "%s+0x%lx", file, (unsigned long)off);
+  return intern(buf);
+}
+
+static uint32_t pc_name(struct image *im, uintptr_t pc) {
+  if ((npc + 1) * 2 > pc_cap) {
+    __typeof__(pcs) old = pcs;
+    size_t old_cap = pc_cap;
+    pc_cap = pc_cap ? pc_cap * 2 : 4096;
+    pcs = calloc(pc_cap, sizeof(pcs[0]));
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].pc == 0) continue;
+      size_t h = (old[i].pc ^ (uintptr_t)old[i].tgid << 20 ^ old[i].gen) * 0x9e3779b97f4a7c15ull >> 20;
+      while (pcs[h & (pc_cap - 1)].pc) h++;
+      pcs[h & (pc_cap - 1)] = old[i];
+    }
+    free(old);
+  }
+  size_t h = (pc ^ (uintptr_t)im->tgid << 20 ^ im->gen) * 0x9e3779b97f4a7c15ull >> 20;
+  for (;; h++) {
+    __typeof__(&pcs[0]) e = &pcs[h & (pc_cap - 1)];
+    if (e->pc == pc && e->tgid == im->tgid && e->gen == im->gen)
+      return e->name;
+    if (e->pc == 0) {
+      e->pc   = pc;
+      e->tgid = im->tgid;
+      e->gen  = im->gen;
+      e->name = symbolize(im, pc);
+      npc++;
+      return e->name;
+    }
+  }
+}
+
+static uint32_t stack_hash(const struct stack *s) {
+  uint32_t h = 2166136261u;
+  h = (h ^ s->nr) * 16777619u;
+  h = (h ^ s->comm) * 16777619u;
+  for (int i = 0; i < s->depth; i++)
+    h = (h ^ s->frames[i]) * 16777619u;
+  return h;
+}
+
+static int stack_eq(const struct stack *a, const struct stack *b) {
+  return a->nr == b->nr && a->comm == b->comm && a->depth == b->depth &&
+         memcmp(a->frames, b->frames, a->depth * sizeof(a->frames[0])) == 0;
+}
+
+static size_t stack_intern(const struct stack *s) {
+  if ((nstack + 1) * 2 > stack_slots) {
+    free(stack_slot);
+    stack_slots = stack_slots ? stack_slots * 2 : 1024;
+    stack_slot = (uint32_t *)calloc(stack_slots, sizeof(uint32_t));
+    for (size_t i = 0; i < nstack; i++) {
+      size_t h = stack_hash(&stacks[i]);
+      while (stack_slot[h & (stack_slots - 1)]) h++;
+      stack_slot[h & (stack_slots - 1)] = i + 1;
+    }
+  }
+  for (size_t h = stack_hash(s); ; h++) {
+    uint32_t *slot = &stack_slot[h & (stack_slots - 1)];
+    if (*slot == 0) {
+      if (nstack == stack_cap) {
+        stack_cap = stack_cap ? stack_cap * 2 : 1024;
+        stacks = (struct stack *)realloc(stacks, stack_cap * sizeof(struct stack));
+      }
+      stacks[nstack] = *s;
+      *slot = ++nstack;
+      return nstack;
+    }
+    if (stack_eq(&stacks[*slot - 1], s))
+      return *slot;
+  }
+}
+
+/* tracee memory, served from one window read at sp when possible */
+struct reader {
+  pid_t     tid;
+  uintptr_t base;
+  size_t    len;
+  char      buf[STACK_WINDOW];
+};
+
+static int peek(struct reader *r, uintptr_t addr, uintptr_t *val) {
+  if (addr >= r->base && addr + sizeof(*val) <= r->base + r->len) {
+    memcpy(val, r->buf + (addr - r->base), sizeof(*val));
+    return 0;
+  }
+  struct iovec local = { val, sizeof(*val) }, remote = { (void *)addr, sizeof(*val) };
+  return process_vm_readv(r->tid, &local, 1, &remote, 1, 0) == sizeof(*val) ? 0 : -1;
+}
+
+/* At a syscall-entry stop: walk the frame-pointer chain of the tracee.
+ * The syscall wrapper itself is usually a leaf without a frame, so its
+ * caller is taken from the word at sp when that points into code. */
+size_t stack_capture(struct task *t, long nr) {
+  struct user_regs_struct regs;
+  static struct reader r;
+  uintptr_t pc[STACK_DEPTH + 2];
+  int n = 0;
+
+  if (ptrace(PTRACE_GETREGS, t->tid, NULL, &regs) < 0)
+    return 0;
+#if __x86_64__
+  uintptr_t ip = regs.rip, sp = regs.rsp, fp = regs.rbp;
+#else
+  uintptr_t ip = regs.eip, sp = regs.esp, fp = regs.ebp;
+#endif
+  struct image *im = image_of(task_tgid(t));
+
+  r.tid  = t->tid;
+  r.base = sp;
+  struct iovec local = { r.buf, STACK_WINDOW }, remote = { (void *)sp, STACK_WINDOW };
+  ssize_t got = process_vm_readv(r.tid, &local, 1, &remote, 1, 0);   /* may stop at the stack top */
+  r.len = got > 0 ? got : 0;
+
+  pc[n++] = ip;
+  uintptr_t ret, next;
+  if (peek(&r, sp, &ret) == 0 && map_find(im, ret))
+    pc[n++] = ret;
+  for (int depth = 0; fp && depth < STACK_DEPTH && n < STACK_DEPTH; depth++) {
+    if ((fp & (sizeof(uintptr_t) - 1)) || peek(&r, fp, &next) < 0 ||
+        peek(&r, fp + sizeof(uintptr_t), &ret) < 0 || !map_find(im, ret))
+      break;                            /* rbp was not a frame pointer here */
+    if (!(n == 2 && ret == pc[1]))      /* the wrapper had a frame after all */
+      pc[n++] = ret;
+    if (next <= fp)
+      break;                            /* stacks grow down, frames go up */
+    fp = next;
+  }
+
+  struct stack s;
+  memset(&s, 0, sizeof(s));
+  s.nr    = nr;
+  s.comm  = im->comm;
+  s.depth = n;
+  for (int i = 0; i < n; i++)                   /* return addresses point */
+    s.frames[n - 1 - i] = pc_name(im, i ? pc[i] - 1 : pc[i]);   /* past the call */
+  return stack_intern(&s);
+}
+
+void stack_add(size_t id, uint64_t ns) {
+  stacks[id - 1].calls += 1;
+  stacks[id - 1].ns    += ns;
+}
+
+/* exec replaced the image, addresses mean something else from now on */
+void stack_exec(struct task *t) {
+  struct image *im = image_of(task_tgid(t));
+  im->gen++;
+  image_load(im);
+}
+
+/* folded stacks: "comm;outer;...;inner;syscall ns", one per line */
+int stack_dump(const char *path) {
+  FILE *fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+  if (fp == NULL)
+    return -1;
+  for (size_t i = 0; i < nstack; i++) {
+    struct stack *s = &stacks[i];
+    if (s->calls == 0) continue;
+    fputs(names[s->comm], fp);
+    for (int j = 0; j < s->depth; j++) {
+      fputc(';', fp);
+      fputs(names[s->frames[j]], fp);
+    }
+    fprintf(fp, ";[%s] %llu\n", syscall_name(s->nr), (unsigned long long)s->ns);
+  }
+  if (fp != stdout)
+    fclose(fp);
+  return 0;
+}
@@ -0,0 +1,176 @@
+#include "sperf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#define LBUF_SIZE     (1 << 16)     /* longest line kept, longer ones are skipped */
+
+enum { MATCH_SUCCESS = 0, MATCH_FAILURE, MATCH_EXIST };
+
+static inline int is_ident(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || (c >= 'A' && c <= 'Z');
+}
+
+/* trailing "<sec.usec>" of strace -T in ns, -1 if the line has none
+ * ("= ?", "<unfinished ...>") */
+static int64_t parse_time(const char *p, const char *end) {
+  while (end > p && (end[-1] == ' ' || end[-1] == '\r')) end--;
+  if (end == p || end[-1] != '>') 
+    return -1;
+
+  const char *q = end - 1;
+  while (q > p && q[-1] != '<' && end - q < 32) q--;
+  if (q == p || q[-1] != '<') 
+    return -1;
+
+  int64_t sec = 0, frac = 0, scale = 1000000000;
+  for (; q < end - 1 && *q >= '0' && *q <= '9'; q++) 
+    sec = sec * 10 + (*q - '0');
+  if (q < end - 1 && *q == '.') {
+    for (q++; q < end - 1 && *q >= '0' && *q <= '9'; q++) {
+      frac = frac * 10 + (*q - '0');
+      scale /= 10;
+    }
+  }
+  if (q != end - 1) 
+    return -1;
+  return sec * 1000000000 + frac * scale;
+}
+
+/* one line of `strace -T [-f]` output, without the '\n':
+ *   [pid  42] read(3, "..."..., 832) = 832 <0.000012>
+ *   [pid  42] futex(0x5610, FUTEX_WAIT, 0, NULL <unfinished ...>
+ *   [pid  42] <... futex resumed>) = 0 <0.501312>
+ * An unfinished call is counted once, from its resumed line, which
+ * carries the time of the whole call. */
+static int parse_line(const char *p, const char *end) {
+  char name[32];
+  const char *name_start, *name_end;
+
+  debug("[LINE][%3d]: %.*s\n", (int)(end - p), (int)(end - p), p);
+  if (end - p > 5 && memcmp(p, "[pid ", 5) == 0) {
+    const char *q = memchr(p, ']', end - p);
+    if (q == NULL) return MATCH_FAILURE;
+    for (p = q + 1; p < end && *p == ' '; p++) ;
+  }
+
+  if (end - p > 5 && memcmp(p, "<... ", 5) == 0) {
+    name_start = p + 5;
+    for (name_end = name_start; name_end < end && is_ident(*name_end); name_end++) ;
+    if (end - name_end < 8 || memcmp(name_end, " resumed", 8) != 0) 
+      return MATCH_FAILURE;
+  } else {
+    name_start = p;
+    for (name_end = name_start; name_end < end && is_ident(*name_end); name_end++) ;
+    if (name_end == name_start || name_end == end || *name_end != '(') 
+      return MATCH_FAILURE;
+  }
+  if (name_end - name_start >= sizeof(name)) 
+    return MATCH_FAILURE;
+
+  int64_t ns = parse_time(name_end, end);
+  if (ns < 0) return MATCH_EXIST;
+
+  memcpy(name, name_start, name_end - name_start);
+  name[name_end - name_start] = '\0';
+  debug("match (%s, %lld)\n", name, (long long)ns);
+  stat_add(name, ns);
+
+  return MATCH_SUCCESS;
+}
+
+/* split the stream into lines in place: memchr finds every '\n' of a read,
+ * only the unfinished tail is moved to the front for the next read */
+static void parse_stream(int fd) {
+  static char buf[LBUF_SIZE];
+  size_t len = 0;
+  ssize_t n;
+  int skipping = 0;                     /* inside an overlong line */
+
+  while ((n = read(fd, buf + len, sizeof(buf) - len)) > 0) {
+    char *p = buf, *end = buf + len + n, *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+      if (!skipping) 
+        parse_line(p, nl);
+      skipping = 0;
+      p = nl + 1;
+    }
+    len = end - p;
+    if (len == sizeof(buf)) {
+      skipping = 1;
+      len = 0;
+    } else if (len > 0 && p != buf) {
+      memmove(buf, p, len);
+    }
+  }
+  if (len > 0 && !skipping)             /* last line without '\n' */
+    parse_line(buf, buf + len);
+}
+
+/* fallback backend: run the command under `strace -T` and parse its text,
+ * or parse an existing log given with -F */
+int trace_strace() {
+  if (opts.input) {
+    int fd = strcmp(opts.input, "-") == 0 ? STDIN_FILENO : open(opts.input, O_RDONLY);
+    if (fd < 0) {
+      perror(opts.input);
+      exit(EXIT_FAILURE);
+    }
+    parse_stream(fd);
+    return 0;
+  }
+
+  int argc = opts.argc;
+  char **argv = opts.argv;
+  const char *filter = opts.filter;
+  int pipefd[2];      /* 0 is read end and 1 is write end */
+  pid_t pid;
+
+  if (pipe(pipefd) == -1) {   /* create a pipe like shell */
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+  debug("hold file descriptor: (%d, %d)\n", pipefd[0], pipefd[1]);
+
+  if ((pid = fork()) < 0 ) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+
+  if (pid == 0) {                        /* child process */
+    char *exec_argv[argc + 5];
+    char *exec_envp[] = { "PATH=/bin", NULL, };
+    char trace_expr[strlen(filter ? filter : "") + 8];
+    int narg = 0;
+
+    exec_argv[narg++] = "strace";
+    exec_argv[narg++] = "-T";
+    if (filter) {
+      snprintf(trace_expr, sizeof(trace_expr), "trace=%s", filter);
+      exec_argv[narg++] = "-e";
+      exec_argv[narg++] = trace_expr;
+    }
+    for (int idx = 0; idx < argc; idx++)
+      exec_argv[narg++] = argv[idx];
+    exec_argv[narg] = NULL;
+
+    close(pipefd[0]);                      /* redirection */
+    dup2(pipefd[1], STDERR_FILENO);
+    close(pipefd[1]);
+
+    execve("/bin/strace", exec_argv, exec_envp);
+    perror("/bin/strace");
+    exit(EXIT_FAILURE);
+
+  } else {                              /* parent process */
+    close(pipefd[1]);
+    parse_stream(pipefd[0]);
+    close(pipefd[0]);
+    waitpid(pid, NULL, 0);
+  }
+
+  return 0;
+}
@@ -0,0 +1,148 @@
+#include "sperf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* traced threads, open addressing on tid */
+static struct task *tasks = NULL;
+static size_t task_cap = 0, task_used = 0, ntask = 0;
+
+/* per-thread totals, kept after the thread is gone */
+static struct thread_stat *threads = NULL;
+static size_t nthread = 0, thread_cap = 0;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void task_grow() {
+  struct task *old = tasks;
+  size_t old_cap = task_cap;
+
+  task_cap = task_cap ? task_cap * 2 : 64;
+  tasks = (struct task *)calloc(task_cap, sizeof(struct task));
+  if (tasks == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  task_used = ntask = 0;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i].tid > 0)
+      *task_find(old[i].tid, 1) = old[i];
+  }
+  free(old);
+}
+
+struct task *task_find(pid_t tid, int create) {
+  if (create && (task_used + 1) * 2 > task_cap)
+    task_grow();
+  if (task_cap == 0)
+    return NULL;
+
+  struct task *tomb = NULL;
+  for (size_t i = (size_t)tid & (task_cap - 1); ; i = (i + 1) & (task_cap - 1)) {
+    struct task *t = &tasks[i];
+    if (t->tid == tid)
+      return t;
+    if (t->tid == -1 && tomb == NULL)
+      tomb = t;
+    if (t->tid == 0) {
+      if (!create) return NULL;
+      if (tomb == NULL) {
+        tomb = t;
+        task_used += 1;
+      }
+      memset(tomb, 0, sizeof(*tomb));
+      tomb->tid   = tid;
+      tomb->fresh = 1;
+      ntask += 1;
+      return tomb;
+    }
+  }
+}
+
+void task_del(struct task *t) {
+  sched_close(t);
+  t->tid = -1;
+  ntask -= 1;
+}
+
+size_t task_count() {
+  return ntask;
+}
+
+/* thread group of t, read once from /proc */
+pid_t task_tgid(struct task *t) {
+  char path[64], line[64];
+  if (t->tgid)
+    return t->tgid;
+  t->tgid = t->tid;
+  snprintf(path, sizeof(path), "/proc/%d/status", t->tid);
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    return t->tgid;
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "Tgid: %d", &t->tgid) == 1) break;
+  }
+  fclose(fp);
+  return t->tgid;
+}
+
+void task_each(void (*fn)(struct task *)) {
+  for (size_t i = 0; i < task_cap; i++) {
+    if (tasks[i].tid > 0)
+      fn(&tasks[i]);
+  }
+}
+
+static void read_comm(struct thread_stat *ts) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/comm", ts->tid);
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL || fgets(ts->comm, sizeof(ts->comm), fp) == NULL)
+    strcpy(ts->comm, "?");
+  ts->comm[strcspn(ts->comm, "\n")] = '\0';
+  if (fp) fclose(fp);
+  if (opts.record)
+    record_comm(ts->tid, ts->comm);
+}
+
+/* a new row, comm is read from /proc if NULL */
+struct thread_stat *thread_put(pid_t tid, const char *comm) {
+  if (nthread == thread_cap) {
+    thread_cap = thread_cap ? thread_cap * 2 : 64;
+    threads = (struct thread_stat *)realloc(threads, thread_cap * sizeof(struct thread_stat));
+  }
+  struct thread_stat *ts = &threads[nthread++];
+  memset(ts, 0, sizeof(*ts));
+  ts->tid = tid;
+  if (comm)
+    strncpy(ts->comm, comm, sizeof(ts->comm) - 1);
+  else
+    read_comm(ts);
+  return ts;
+}
+
+struct thread_stat *thread_add(struct task *t, uint64_t ns) {
+  if (t->ts == 0) {
+    thread_put(t->tid, NULL);
+    t->ts = nthread;
+  }
+  threads[t->ts - 1].calls += 1;
+  threads[t->ts - 1].ns    += ns;
+  return &threads[t->ts - 1];
+}
+
+/* a successful exec renamed the thread */
+void thread_exec(struct task *t) {
+  if (t->ts)
+    read_comm(&threads[t->ts - 1]);
+}
+
+struct thread_stat *thread_stats(size_t *n) {
+  *n = nthread;
+  return threads;
+}
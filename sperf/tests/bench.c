@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+/*
+ * Tracing overhead of the sperf backends.
+ *
+ * Every workload runs untraced, then under each backend that works here.
+ * Results are one JSON object per line on stdout, like libco's bench, so
+ * they can be appended to a file and compared across releases:
+ *
+ *   {"bench":"pipe","backend":"ptrace","ops":100000,"ns_per_op":25022.7,
+ *    "slowdown":33.56,"events":200037,"events_per_sec":79783,"lost":0}
+ *
+ * slowdown is the workload loop, traced over untraced; events/s is what
+ * sperf got through, its own start and report included. A backend that
+ * saw none of the workload's calls prints "observed":false instead.
+ *
+ * Given the output of an earlier run as baseline, the exit status is 1 if
+ * any slowdown grew more than MAX_REGRESS times, which fails make bench.
+ *
+ * Usage: sperf-bench-64 [scale [baseline]]   (iterations times scale, default 1)
+ *        sperf-bench-64 --run workload n out   (the tracee)
+ */
+
+#define SPERF         "../sperf-64"
+#define MAX_REGRESS   3.0       /* run to run noise reaches 2x on a busy host */
+
+static const char *backends[] = { "ptrace", "perf", "preload", "strace" };
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// -----------------------------------------------
+// workloads, each n operations
+
+static void run_getpid(long n) {
+  for (long i = 0; i < n; i++)
+    syscall(SYS_getpid);
+}
+
+/* a 64-byte write and read through a pipe */
+static void run_pipe(long n) {
+  int fd[2];
+  char buf[64] = { 0 };
+  if (pipe(fd) < 0) exit(1);
+  for (long i = 0; i < n; i++) {
+    write(fd[1], buf, sizeof(buf));
+    read(fd[0], buf, sizeof(buf));
+  }
+}
+
+/* two threads hand a token back and forth, every wait sleeps on a futex */
+static sem_t ping, pong;
+static long  rounds;
+
+static void *ponger(void *arg) {
+  for (long i = 0; i < rounds; i++) {
+    sem_wait(&ping);
+    sem_post(&pong);
+  }
+  return NULL;
+}
+
+static void run_futex(long n) {
+  pthread_t t;
+  rounds = n;
+  sem_init(&ping, 0, 0);
+  sem_init(&pong, 0, 0);
+  pthread_create(&t, NULL, ponger, NULL);
+  for (long i = 0; i < n; i++) {
+    sem_post(&ping);
+    sem_wait(&pong);
+  }
+  pthread_join(t, NULL);
+}
+
+/* allocator churn: map 16 KB to 1 MB, touch it, unmap */
+static void run_mmap(long n) {
+  unsigned seed = 1;
+  for (long i = 0; i < n; i++) {
+    size_t len = (16 << 10) << (rand_r(&seed) % 7);
+    char *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) exit(1);
+    p[0] = p[len - 1] = 1;
+    munmap(p, len);
+  }
+}
+
+static const struct workload {
+  const char *name;
+  void      (*run)(long n);
+  long        n;
+} workloads[] = {
+  { "getpid", run_getpid, 200000 },
+  { "pipe",   run_pipe,   100000 },
+  { "futex",  run_futex,  50000  },
+  { "mmap",   run_mmap,   20000  },
+};
+
+#define NWORKLOAD (sizeof(workloads) / sizeof(workloads[0]))
+
+/* the tracee: run one workload, write its loop time to out */
+static int tracee(const char *name, long n, const char *out) {
+  for (int i = 0; i < NWORKLOAD; i++) {
+    if (strcmp(workloads[i].name, name) != 0) continue;
+    uint64_t t0 = now_ns();
+    workloads[i].run(n);
+    uint64_t ns = now_ns() - t0;
+    FILE *fp = fopen(out, "w");
+    if (fp == NULL) return 1;
+    fprintf(fp, "%llu\n", (unsigned long long)ns);
+    fclose(fp);
+    return 0;
+  }
+  return 1;
+}
+
+// -----------------------------------------------
+// the driver
+
+static char self[4096], dir[64];
+
+static int in_path(const char *prog) {
+  char *path = strdup(getenv("PATH") ? getenv("PATH") : ""), *save = NULL, file[4096];
+  int found = 0;
+  for (char *d = strtok_r(path, ":", &save); d && !found; d = strtok_r(NULL, ":", &save)) {
+    snprintf(file, sizeof(file), "%s/%s", d, prog);
+    found = access(file, X_OK) == 0;
+  }
+  free(path);
+  return found;
+}
+
+/* "key": value from a sperf -x file, 0 if absent */
+static uint64_t json_value(const char *file, const char *key) {
+  char line[512], pat[64];
+  unsigned long long v = 0;
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) return 0;
+  snprintf(pat, sizeof(pat), " \"%s\": %%llu", key);
+  while (fgets(line, sizeof(line), fp) && sscanf(line, pat, &v) != 1) ;
+  fclose(fp);
+  return v;
+}
+
+static int grep(const char *file, const char *text) {
+  char line[512];
+  int found = 0;
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) return 0;
+  while (!found && fgets(line, sizeof(line), fp))
+    found = strstr(line, text) != NULL;
+  fclose(fp);
+  return found;
+}
+
+/* slowdown of bench under backend in an earlier run's output, 0 if absent */
+static double baseline(const char *file, const char *bench, const char *backend) {
+  char line[512], row[128];
+  double v = 0;
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) return 0;
+  snprintf(row, sizeof(row), "{\"bench\":\"%s\",\"backend\":\"%s\",", bench, backend);
+  while (v == 0 && fgets(line, sizeof(line), fp)) {
+    char *p = strstr(line, "\"slowdown\":");
+    if (strncmp(line, row, strlen(row)) == 0 && p != NULL)
+      v = atof(p + strlen("\"slowdown\":"));
+  }
+  fclose(fp);
+  return v;
+}
+
+/* run the tracee, under sperf -b backend unless NULL; -1 if that failed or
+ * sperf fell back to another backend */
+static int run(const struct workload *w, long n, const char *backend, uint64_t *loop_ns, uint64_t *wall_ns) {
+  char num[32], out[128], json[128], err[128];
+  snprintf(num, sizeof(num), "%ld", n);
+  snprintf(out, sizeof(out), "%s/loop", dir);
+  snprintf(json, sizeof(json), "%s/stat.json", dir);
+  snprintf(err, sizeof(err), "%s/stderr", dir);
+  unlink(out);
+
+  uint64_t t0 = now_ns();
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (!freopen("/dev/null", "w", stdout) || !freopen(err, "w", stderr)) _exit(127);
+    if (backend)
+      execl(SPERF, SPERF, "-b", backend, "-x", json, self, "--run", w->name, num, out, (char *)NULL);
+    else
+      execl(self, self, "--run", w->name, num, out, (char *)NULL);
+    _exit(127);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  *wall_ns = now_ns() - t0;
+
+  FILE *fp = fopen(out, "r");
+  unsigned long long ns = 0;
+  int ok = fp && fscanf(fp, "%llu", &ns) == 1;
+  if (fp) fclose(fp);
+  *loop_ns = ns;
+  if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || grep(err, "falling back"))
+    return -1;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 5 && strcmp(argv[1], "--run") == 0)
+    return tracee(argv[2], atol(argv[3]), argv[4]);
+
+  double scale = argc > 1 ? atof(argv[1]) : 1;
+  const char *base = argc > 2 ? argv[2] : NULL;
+  int regressed = 0;
+  setbuf(stdout, NULL);
+  if (realpath("/proc/self/exe", self) == NULL) return 1;
+  strcpy(dir, "/tmp/sperf-bench.XXXXXX");
+  if (mkdtemp(dir) == NULL) return 1;
+
+  for (int i = 0; i < NWORKLOAD; i++) {
+    const struct workload *w = &workloads[i];
+    long n = w->n * scale > 1 ? w->n * scale : 1;
+    uint64_t base_ns, wall_ns, loop_ns;
+    if (run(w, n, NULL, &base_ns, &wall_ns) < 0) {
+      fprintf(stderr, "sperf-bench: %s does not run\n", w->name);
+      continue;
+    }
+    printf("{\"bench\":\"%s\",\"backend\":\"none\",\"ops\":%ld,\"ns_per_op\":%.1f}\n",
+           w->name, n, (double)base_ns / n);
+
+    for (int b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+      if (strcmp(backends[b], "strace") == 0 && !in_path("strace")) continue;
+      if (run(w, n, backends[b], &loop_ns, &wall_ns) < 0) {
+        printf("{\"bench\":\"%s\",\"backend\":\"%s\",\"available\":false}\n", w->name, backends[b]);
+        continue;
+      }
+      char json[128];
+      snprintf(json, sizeof(json), "%s/stat.json", dir);
+      uint64_t events = json_value(json, "calls"), lost = json_value(json, "lost");
+      if (events == 0) {        // e.g. preload wraps neither getpid nor mmap
+        printf("{\"bench\":\"%s\",\"backend\":\"%s\",\"observed\":false}\n", w->name, backends[b]);
+        continue;
+      }
+      double slowdown = (double)loop_ns / (base_ns ? base_ns : 1);
+      printf("{\"bench\":\"%s\",\"backend\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.1f,"
+             "\"slowdown\":%.2f,\"events\":%llu,\"events_per_sec\":%.0f,\"lost\":%llu}\n",
+             w->name, backends[b], n, (double)loop_ns / n, slowdown,
+             (unsigned long long)events, events * 1e9 / (wall_ns ? wall_ns : 1), (unsigned long long)lost);
+      double old = base ? baseline(base, w->name, backends[b]) : 0;
+      if (old > 0 && slowdown > old * MAX_REGRESS) {
+        fprintf(stderr, "sperf-bench: %s under %s regressed, slowdown %.2f was %.2f\n",
+                w->name, backends[b], slowdown, old);
+        regressed = 1;
+      }
+    }
+  }
+
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  system(cmd);
+  return regressed;
+}
@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <assert.h>
+#include <time.h>
 
 void entry(void* arg) {
     int num = *((int *)arg);
@@ -12,7 +14,244 @@ void entry(void* arg) {
     sleep(1);
 }
 
+static int ticks = 0, order[3], norder = 0;
+
+void tick(void* arg) {
+    __atomic_add_fetch(&ticks, 1, __ATOMIC_RELAXED);
+}
+
+void record(void* arg) {
+    order[__atomic_fetch_add(&norder, 1, __ATOMIC_RELAXED)] = *(int *)arg;
+}
+
+void never(void* arg) {
+    assert(0);
+}
+
+void test_timers() {
+    ThreadPool* pool = tp_create(2, 4, 20);
+
+    // periodic, then cancelled
+    TimerID every = tp_add_every(pool, 50, tick, NULL);
+    usleep(1000 * 1000);
+    int n = __atomic_load_n(&ticks, __ATOMIC_RELAXED);
+    printf("timer: %d ticks of 50 ms in 1 s\n", n);
+    assert(n >= 15 && n <= 21);
+    assert(tp_cancel(pool, every) == 0);
+    usleep(50 * 1000);
+    n = __atomic_load_n(&ticks, __ATOMIC_RELAXED);
+    usleep(200 * 1000);
+    assert(__atomic_load_n(&ticks, __ATOMIC_RELAXED) == n);
+    assert(tp_cancel(pool, every) == -1);
+
+    // one-shot timers run in deadline order, the handles go stale
+    TimerID ids[3];
+    for (int i = 0; i < 3; i++) {
+        int *num = (int *)malloc(sizeof(int));
+        *num = 3 - i;
+        ids[i] = tp_add_after(pool, (3 - i) * 100, record, num);
+    }
+    usleep(500 * 1000);
+    assert(norder == 3 && order[0] == 1 && order[1] == 2 && order[2] == 3);
+    for (int i = 0; i < 3; i++)
+        assert(tp_cancel(pool, ids[i]) == -1);
+
+    // many pending timers, all cancelled before they fire
+    static TimerID many[10000];
+    for (int i = 0; i < 10000; i++)
+        many[i] = tp_add_after(pool, 1000 + i % 997, never, NULL);
+    for (int i = 0; i < 10000; i += 2)
+        assert(tp_cancel(pool, many[i]) == 0);
+    for (int i = 1; i < 10000; i += 2)
+        assert(tp_cancel(pool, many[i]) == 0);
+    assert(pool->heapSize == 0);
+    usleep(100 * 1000);
+
+    tp_destroy(pool);
+}
+
+static volatile int gate = 0;
+static int ran[16], nran = 0;
+
+void hold(void* arg) {
+    while (!gate) usleep(1000);
+}
+
+void mark(void* arg) {
+    ran[__atomic_fetch_add(&nran, 1, __ATOMIC_RELAXED)] = *(int *)arg;
+}
+
+static pthread_t ranIn;
+
+void whoami(void* arg) {
+    ranIn = pthread_self();
+}
+
+// one worker held by `hold`, a queue of 2 filled behind it
+ThreadPool* full_pool(Overflow policy) {
+    ThreadPool* pool = tp_create_policy(1, 1, 2, policy);
+    gate = 0;
+    tp_add(pool, hold, NULL);
+    while (tp_busy(pool) == 0) usleep(1000);
+    tp_add(pool, hold, NULL);
+    tp_add(pool, hold, NULL);
+    return pool;
+}
+
+void drain(ThreadPool* pool) {
+    gate = 1;
+    while (pool->qSize > 0 || pool->spillSize > 0 || tp_busy(pool) > 0) usleep(1000);
+    tp_destroy(pool);
+}
+
+void test_overflow() {
+    TpStats st;
+
+    ThreadPool* pool = full_pool(TP_REJECT);
+    assert(tp_add(pool, hold, NULL) == -1);
+    assert(tp_try_add(pool, hold, NULL) == -1);
+    assert(tp_add_timed(pool, hold, NULL, 100) == -1);
+    tp_stats(pool, &st);
+    assert(st.added == 3 && st.rejected == 2 && st.timedOut == 1);
+    drain(pool);
+
+    pool = full_pool(TP_CALLER_RUNS);
+    assert(tp_add(pool, whoami, NULL) == 0);
+    tp_stats(pool, &st);
+    assert(st.callerRuns == 1 && pthread_equal(ranIn, pthread_self()));
+    drain(pool);
+
+    pool = full_pool(TP_SPILL);
+    for (int i = 0; i < 16; i++) {
+        int *num = (int *)malloc(sizeof(int));
+        *num = i;
+        assert(tp_add(pool, mark, num) == 0);
+    }
+    tp_stats(pool, &st);
+    printf("spill: %ld spilled, %d on the list, %ld added\n", st.spilled, st.spillSize, st.added);
+    assert(st.spilled == 16 && st.spillSize == 16);
+    drain(pool);
+    assert(nran == 16);
+    for (int i = 0; i < 16; i++)
+        assert(ran[i] == i);
+
+    // room frees up while tp_add_timed waits
+    pool = full_pool(TP_BLOCK);
+    gate = 1;
+    assert(tp_add_timed(pool, hold, NULL, 5000) == 0);
+    drain(pool);
+}
+
+#define PRODUCERS    4
+#define PER_PRODUCER 50000
+
+static int counted = 0;
+
+void count(void* arg) {
+    __atomic_add_fetch(&counted, 1, __ATOMIC_RELAXED);
+}
+
+typedef struct Producer_t {
+    ThreadPool* pool;
+    int ringSize;               // 0 submits with tp_add
+} Producer;
+
+void* produce(void* arg) {
+    Producer* p = (Producer *)arg;
+    TpRing* ring = p->ringSize ? tp_ring_open(p->pool, p->ringSize) : NULL;
+    assert(p->ringSize == 0 || ring != NULL);
+    for (int i = 0; i < PER_PRODUCER; i++) {
+        if (ring) assert(tp_ring_add(ring, count, NULL) == 0);
+        else      assert(tp_add(p->pool, count, NULL) == 0);
+    }
+    if (ring) tp_ring_close(ring);
+    return NULL;
+}
+
+// every producer at once, through tp_add, its own ring, and a ring so
+// small that most submits fall back to tp_add
+void test_rings() {
+    const char *names[] = { "tp_add", "ring", "small ring" };
+    int sizes[] = { 0, PER_PRODUCER, 16 };
+    int total = PRODUCERS * PER_PRODUCER;
+
+    for (int m = 0; m < 3; m++) {
+        ThreadPool* pool = tp_create(2, 4, total);
+        Producer p = { pool, sizes[m] };
+        pthread_t tids[PRODUCERS];
+        struct timespec t0, t1;
+
+        counted = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < PRODUCERS; i++)
+            pthread_create(&tids[i], NULL, produce, &p);
+        for (int i = 0; i < PRODUCERS; i++)
+            pthread_join(tids[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        // no wakeup lost: everything runs without more submits
+        for (int i = 0; i < 10000 && __atomic_load_n(&counted, __ATOMIC_RELAXED) < total; i++)
+            usleep(1000);
+        TpStats st;
+        tp_stats(pool, &st);
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("%s: %d producers, %.0f submits/s, %ld on rings\n",
+               names[m], PRODUCERS, total / secs, st.ringAdded);
+        assert(counted == total && st.added + st.ringAdded == total);
+        assert(m == 0 ? st.ringAdded == 0 : st.ringAdded > 0);
+        assert(pool->nRings == 0);
+        tp_destroy(pool);
+    }
+}
+
+static int napped = 0;
+
+void nap(void* arg) {
+    usleep(500 * 1000);
+    __atomic_add_fetch(&napped, 1, __ATOMIC_RELAXED);
+}
+
+void long_nap(void* arg) {
+    sleep(2);
+}
+
+static double seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ring tasks spread over the idle workers, and do not wait for a busy one
+void test_ring_parallel() {
+    ThreadPool* pool = tp_create(4, 4, 16);
+    usleep(100 * 1000);                 // every worker asleep
+
+    TpRing* ring = tp_ring_open(pool, 16);
+    double t0 = seconds();
+    for (int i = 0; i < 4; i++)
+        assert(tp_ring_add(ring, nap, NULL) == 0);
+    while (__atomic_load_n(&napped, __ATOMIC_RELAXED) < 4) usleep(1000);
+    double par = seconds() - t0;
+
+    assert(tp_add(pool, long_nap, NULL) == 0);
+    while (tp_busy(pool) == 0) usleep(1000);
+    t0 = seconds();
+    assert(tp_ring_add(ring, nap, NULL) == 0);
+    while (__atomic_load_n(&napped, __ATOMIC_RELAXED) < 5) usleep(1000);
+    double beside = seconds() - t0;
+
+    printf("ring: 4 naps of 0.5 s in %.2f s, one beside a busy worker in %.2f s\n", par, beside);
+    assert(par < 1.0 && beside < 1.0);
+    tp_ring_close(ring);
+    tp_destroy(pool);
+}
+
 int main() {
+    test_timers();
+    test_overflow();
+    test_rings();
+    test_ring_parallel();
+
     ThreadPool* pool = tp_create(3, 6, 20);
     for(int i = 0; i < 50; i++) {
         int *num = (int *)malloc(sizeof(int));
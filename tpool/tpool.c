@@ -4,17 +4,38 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
 
 #define INC_NUM 3
+#define TIMER_SLOTS 64          // first allocation of timer slots
+#define GEN_MASK 0x7fffffff    // generation bits of a TimerID, which stays >= 0
+#define RING_SLOTS 8            // first allocation of the ring array
+
+#ifdef TP_DEBUG
+  #define debug(...) printf(__VA_ARGS__)
+#else
+  #define debug(...)
+#endif
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
 /* Thread Pooll API */
 ThreadPool* tp_create(int min, int max, int qSize) {
+    return tp_create_policy(min, max, qSize, TP_BLOCK);
+}
+
+ThreadPool* tp_create_policy(int min, int max, int qSize, Overflow policy) {
     ThreadPool *tpool = (ThreadPool *)malloc(sizeof(ThreadPool));    
     if(tpool == NULL) {
         printf("thread pool malloc fail..\n");
         goto FAIL;
     }
 
+    tpool->taskQ = NULL;
     tpool->threadIDs = (pthread_t *)malloc(sizeof(pthread_t) * max);
     if(tpool->threadIDs == NULL) {
         printf("threadIDs malloc fail..\n");
@@ -28,10 +49,14 @@ ThreadPool* tp_create(int min, int max, int qSize) {
     tpool->busyNum = 0;
     tpool->exitNum = 0; 
 
+    // idle workers wait for timer deadlines on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
     if (pthread_mutex_init(&tpool->mutexPool, NULL) != 0 || 
         pthread_mutex_init(&tpool->mutexBusy, NULL) != 0 ||
-        pthread_cond_init(&tpool->notEmpty, NULL) != 0 ||
-        pthread_cond_init(&tpool->notFull, NULL) != 0) 
+        pthread_cond_init(&tpool->notEmpty, &attr) != 0 ||
+        pthread_cond_init(&tpool->notFull, &attr) != 0) 
     {
         printf("mutex or condition init fail..\n");
         goto FAIL;
@@ -43,9 +68,28 @@ ThreadPool* tp_create(int min, int max, int qSize) {
     tpool->qSize  = 0;
     tpool->qFront = 0;
     tpool->qRear  = 0;
+    tpool->policy    = policy;
+    tpool->spillHead = NULL;
+    tpool->spillTail = NULL;
+    tpool->spillSize = 0;
+    memset(&tpool->stats, 0, sizeof(tpool->stats));
+
+    tpool->rings    = NULL;
+    tpool->nRings   = 0;
+    tpool->ringCap  = 0;
+    tpool->ringNext = 0;
+    tpool->ringTurn = 0;
+    tpool->idleNum  = 0;
 
     tpool->shutdown = 0;
 
+    tpool->timers      = NULL;
+    tpool->tCapacity   = 0;
+    tpool->tFree       = -1;
+    tpool->timerHeap   = NULL;
+    tpool->heapSize    = 0;
+    tpool->timerWaiter = 0;
+
     pthread_create(&tpool->managerID, NULL, manager, tpool);
     for(int i = 0; i < min; ++i) {
         pthread_create(&tpool->threadIDs[i], NULL, worker, tpool);
@@ -64,17 +108,49 @@ FAIL:
 int tp_destroy(ThreadPool* tpool) {
     if (tpool == NULL) return -1;
 
+    pthread_mutex_lock(&tpool->mutexPool);
     tpool->shutdown = 1;
+    pthread_mutex_unlock(&tpool->mutexPool);
     pthread_join(tpool->managerID, NULL);
 
-    // signal consumer thread
-    for (int i = 0; i < tpool->liveNum; ++i) {
-        pthread_cond_signal(&tpool->notEmpty);
+    // wake every consumer and producer, wait until the workers are gone:
+    // a task still running finishes first, and nothing touches the pool
+    // once it is freed
+    pthread_mutex_lock(&tpool->mutexPool);
+    pthread_cond_broadcast(&tpool->notEmpty);
+    pthread_cond_broadcast(&tpool->notFull);
+    pthread_mutex_unlock(&tpool->mutexPool);
+    for (int i = 0; i < tpool->maxNum; ++i) {
+        if (tpool->threadIDs[i] != 0) pthread_join(tpool->threadIDs[i], NULL);
     }
 
     if(tpool->taskQ)     free(tpool->taskQ);
     if(tpool->threadIDs) free(tpool->threadIDs);
 
+    while (tpool->spillHead) {
+        Spill *node = tpool->spillHead;
+        tpool->spillHead = node->next;
+        free(node->task.arg);
+        free(node);
+    }
+
+    // so do the tasks left in the rings
+    for (int i = 0; i < tpool->nRings; ++i) {
+        TpRing *ring = tpool->rings[i];
+        for (unsigned j = ring->head; j != ring->tail; ++j)
+            free(ring->slots[j & ring->mask].arg);
+        free(ring->slots);
+        free(ring);
+    }
+    if(tpool->rings)     free(tpool->rings);
+
+    // timers that never ran again own their arg
+    for (int i = 0; i < tpool->heapSize; ++i) {
+        free(tpool->timers[tpool->timerHeap[i]].task.arg);
+    }
+    if(tpool->timers)    free(tpool->timers);
+    if(tpool->timerHeap) free(tpool->timerHeap);
+
     pthread_mutex_destroy(&tpool->mutexBusy);
     pthread_mutex_destroy(&tpool->mutexPool);
     pthread_cond_destroy(&tpool->notEmpty);
@@ -84,6 +160,16 @@ int tp_destroy(ThreadPool* tpool) {
     return 0;
 }
 
+// mutexPool held, taskQ has room
+static void enqueue(ThreadPool* tpool, void(*func)(void*), void* arg) {
+    tpool->taskQ[tpool->qRear].entry = func;
+    tpool->taskQ[tpool->qRear].arg = arg;
+    tpool->qRear = (tpool->qRear + 1) % tpool->qCapacity;
+    tpool->qSize += 1;
+
+    pthread_cond_signal(&tpool->notEmpty);
+}
+
 int tp_add(ThreadPool* tpool, void(*func)(void*), void* arg) {
     pthread_mutex_lock(&tpool->mutexPool);
     
@@ -93,19 +179,348 @@ int tp_add(ThreadPool* tpool, void(*func)(void*), void* arg) {
     }
 
     assert(tpool->shutdown == 0);
-    while(tpool->qSize == tpool->qCapacity)
-        pthread_cond_wait(&tpool->notFull, &tpool->mutexPool);
+    // the overflow list is only ever filled while taskQ is full
+    if (tpool->qSize == tpool->qCapacity) {
+        switch (tpool->policy) {
+        case TP_REJECT:
+            tpool->stats.rejected += 1;
+            pthread_mutex_unlock(&tpool->mutexPool);
+            return -1;
 
-    tpool->taskQ[tpool->qRear].entry = func;
-    tpool->taskQ[tpool->qRear].arg = arg;
-    tpool->qRear = (tpool->qRear + 1) % tpool->qCapacity;
-    tpool->qSize += 1;
+        case TP_CALLER_RUNS:
+            tpool->stats.callerRuns += 1;
+            pthread_mutex_unlock(&tpool->mutexPool);
+            func(arg);
+            free(arg);
+            return 0;
+
+        case TP_SPILL: {
+            // behind everything queued, so the order stays FIFO
+            Spill *node = (Spill *)malloc(sizeof(Spill));
+            if (node == NULL) {
+                pthread_mutex_unlock(&tpool->mutexPool);
+                return -1;
+            }
+            node->task.entry = func;
+            node->task.arg   = arg;
+            node->next       = NULL;
+            if (tpool->spillTail) tpool->spillTail->next = node;
+            else                  tpool->spillHead = node;
+            tpool->spillTail  = node;
+            tpool->spillSize += 1;
+            tpool->stats.spilled += 1;
+            pthread_cond_signal(&tpool->notEmpty);
+            pthread_mutex_unlock(&tpool->mutexPool);
+            return 0;
+        }
 
-    pthread_cond_signal(&tpool->notEmpty);
+        default:
+            tpool->stats.blocked += 1;
+            while(tpool->qSize == tpool->qCapacity && !tpool->shutdown)
+                pthread_cond_wait(&tpool->notFull, &tpool->mutexPool);
+            if (tpool->shutdown) {
+                pthread_mutex_unlock(&tpool->mutexPool);
+                return -1;
+            }
+        }
+    }
+
+    enqueue(tpool, func, arg);
+    tpool->stats.added += 1;
+    pthread_mutex_unlock(&tpool->mutexPool);
+    return 0;
+}
+
+int tp_add_timed(ThreadPool* tpool, void(*func)(void*), void* arg, long timeoutMs) {
+    long long when = now_ns() + timeoutMs * 1000000LL;
+    struct timespec ts = { when / 1000000000LL, when % 1000000000LL };
+    int timedOut = 0;
+
+    pthread_mutex_lock(&tpool->mutexPool);
+    while (tpool->qSize == tpool->qCapacity && !tpool->shutdown && !timedOut) {
+        if (timeoutMs <= 0 || pthread_cond_timedwait(&tpool->notFull, &tpool->mutexPool, &ts) != 0)
+            timedOut = 1;
+    }
+    if (tpool->shutdown || tpool->qSize == tpool->qCapacity) {
+        if (!tpool->shutdown && timeoutMs <= 0) tpool->stats.rejected += 1;
+        else if (!tpool->shutdown)              tpool->stats.timedOut += 1;
+        pthread_mutex_unlock(&tpool->mutexPool);
+        return -1;
+    }
+
+    enqueue(tpool, func, arg);
+    tpool->stats.added += 1;
     pthread_mutex_unlock(&tpool->mutexPool);
     return 0;
 }
 
+int tp_try_add(ThreadPool* tpool, void(*func)(void*), void* arg) {
+    return tp_add_timed(tpool, func, arg, 0);
+}
+
+void tp_stats(ThreadPool* tpool, TpStats* stats) {
+    pthread_mutex_lock(&tpool->mutexPool);
+    *stats = tpool->stats;
+    stats->spillSize = tpool->spillSize;
+    for (int i = 0; i < tpool->nRings; ++i)
+        stats->ringAdded += __atomic_load_n(&tpool->rings[i]->added, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&tpool->mutexPool);
+}
+
+/* Producer rings: a producer fills its own ring without the lock and only
+ * touches shared state to wake a sleeping worker. That wakeup is a Dekker
+ * pair: the producer publishes tail and then reads idleNum, a worker raises
+ * idleNum and then looks at the rings, each with a full fence in between,
+ * so at least one of them sees the other. The workers take from the rings
+ * under mutexPool, which makes them a single consumer. */
+TpRing* tp_ring_open(ThreadPool* tpool, int capacity) {
+    int cap = 1;
+    while (cap < capacity) cap <<= 1;
+
+    TpRing *ring = NULL;
+    if (posix_memalign((void **)&ring, 64, sizeof(TpRing)) != 0) return NULL;
+    memset(ring, 0, sizeof(TpRing));
+    ring->slots = (Task *)malloc(sizeof(Task) * cap);
+    ring->mask  = cap - 1;
+    ring->pool  = tpool;
+
+    pthread_mutex_lock(&tpool->mutexPool);
+    if (ring->slots == NULL || tpool->shutdown) goto FAIL;
+    if (tpool->nRings == tpool->ringCap) {
+        int n = tpool->ringCap ? tpool->ringCap * 2 : RING_SLOTS;
+        TpRing **rings = (TpRing **)realloc(tpool->rings, sizeof(TpRing *) * n);
+        if (rings == NULL) goto FAIL;
+        tpool->rings   = rings;
+        tpool->ringCap = n;
+    }
+    tpool->rings[tpool->nRings++] = ring;
+    pthread_mutex_unlock(&tpool->mutexPool);
+    return ring;
+
+FAIL:
+    pthread_mutex_unlock(&tpool->mutexPool);
+    free(ring->slots);
+    free(ring);
+    return NULL;
+}
+
+int tp_ring_add(TpRing* ring, void(*func)(void*), void* arg) {
+    ThreadPool *tpool = ring->pool;
+    unsigned tail = ring->tail;
+
+    if (tail - ring->headCache > ring->mask) {
+        ring->headCache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->headCache > ring->mask)
+            return tp_add(tpool, func, arg);
+    }
+    if (__atomic_load_n(&tpool->shutdown, __ATOMIC_RELAXED)) return -1;
+
+    ring->slots[tail & ring->mask].entry = func;
+    ring->slots[tail & ring->mask].arg   = arg;
+    __atomic_store_n(&ring->added, ring->added + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    // wake a worker when the ring was empty; while it is not, the worker
+    // that takes a task wakes the next one for the rest (see worker)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&tpool->idleNum, __ATOMIC_RELAXED) > 0 &&
+        __atomic_load_n(&ring->head, __ATOMIC_RELAXED) == tail) {
+        pthread_mutex_lock(&tpool->mutexPool);
+        pthread_cond_signal(&tpool->notEmpty);
+        pthread_mutex_unlock(&tpool->mutexPool);
+    }
+    return 0;
+}
+
+// mutexPool held, the ring is closed and empty
+static void ring_free(ThreadPool* tpool, TpRing* ring) {
+    for (int i = 0; i < tpool->nRings; ++i) {
+        if (tpool->rings[i] != ring) continue;
+        tpool->rings[i] = tpool->rings[--tpool->nRings];
+        break;
+    }
+    if (tpool->ringNext >= tpool->nRings) tpool->ringNext = 0;
+    tpool->stats.ringAdded += ring->added;
+    free(ring->slots);
+    free(ring);
+}
+
+void tp_ring_close(TpRing* ring) {
+    ThreadPool *tpool = ring->pool;
+    pthread_mutex_lock(&tpool->mutexPool);
+    ring->closed = 1;
+    // otherwise the worker that takes the last task frees it
+    if (ring->head == ring->tail) ring_free(tpool, ring);
+    pthread_mutex_unlock(&tpool->mutexPool);
+}
+
+// mutexPool held: the next ring with a task, round-robin
+static TpRing* ring_next(ThreadPool* tpool) {
+    for (int n = 0; n < tpool->nRings; ++n) {
+        int i = (tpool->ringNext + n) % tpool->nRings;
+        TpRing *ring = tpool->rings[i];
+        if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head) {
+            tpool->ringNext = (i + 1) % tpool->nRings;
+            return ring;
+        }
+    }
+    return NULL;
+}
+
+// mutexPool held: tasks waiting in the rings
+static int ring_backlog(ThreadPool* tpool) {
+    int n = 0;
+    for (int i = 0; i < tpool->nRings; ++i)
+        n += __atomic_load_n(&tpool->rings[i]->tail, __ATOMIC_ACQUIRE) - tpool->rings[i]->head;
+    return n;
+}
+
+/* Timers: slots in an array, the pending ones in a binary min-heap on the
+ * deadline. Adding or cancelling is O(log n) under mutexPool; a pending
+ * timer costs nothing else, one idle worker sleeps until the first
+ * deadline and the due timer runs on a worker like a task. */
+static int timer_less(ThreadPool* tpool, int a, int b) {
+    return tpool->timers[tpool->timerHeap[a]].when < tpool->timers[tpool->timerHeap[b]].when;
+}
+
+static void heap_swap(ThreadPool* tpool, int a, int b) {
+    int slot = tpool->timerHeap[a];
+    tpool->timerHeap[a] = tpool->timerHeap[b];
+    tpool->timerHeap[b] = slot;
+    tpool->timers[tpool->timerHeap[a]].heapIdx = a;
+    tpool->timers[tpool->timerHeap[b]].heapIdx = b;
+}
+
+static void heap_up(ThreadPool* tpool, int i) {
+    while (i > 0 && timer_less(tpool, i, (i - 1) / 2)) {
+        heap_swap(tpool, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(ThreadPool* tpool, int i) {
+    while (1) {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < tpool->heapSize && timer_less(tpool, l, min)) min = l;
+        if (r < tpool->heapSize && timer_less(tpool, r, min)) min = r;
+        if (min == i) break;
+        heap_swap(tpool, i, min);
+        i = min;
+    }
+}
+
+// pending from here on; wake the worker that sleeps until the old first deadline
+static void heap_push(ThreadPool* tpool, int slot) {
+    Timer *t = &tpool->timers[slot];
+    t->state = TIMER_PENDING;
+    t->heapIdx = tpool->heapSize;
+    tpool->timerHeap[tpool->heapSize++] = slot;
+    heap_up(tpool, t->heapIdx);
+    if (t->heapIdx == 0)
+        pthread_cond_broadcast(&tpool->notEmpty);
+}
+
+static void heap_remove(ThreadPool* tpool, int i) {
+    tpool->timers[tpool->timerHeap[i]].heapIdx = -1;
+    if (i != --tpool->heapSize) {
+        tpool->timerHeap[i] = tpool->timerHeap[tpool->heapSize];
+        tpool->timers[tpool->timerHeap[i]].heapIdx = i;
+        heap_up(tpool, i);
+        heap_down(tpool, tpool->timers[tpool->timerHeap[i]].heapIdx);
+    }
+}
+
+static int slot_alloc(ThreadPool* tpool) {
+    if (tpool->tFree < 0) {
+        int cap = tpool->tCapacity ? tpool->tCapacity * 2 : TIMER_SLOTS;
+        Timer *timers = (Timer *)realloc(tpool->timers, sizeof(Timer) * cap);
+        int *heap = (int *)realloc(tpool->timerHeap, sizeof(int) * cap);
+        if (timers) tpool->timers = timers;
+        if (heap)   tpool->timerHeap = heap;
+        if (timers == NULL || heap == NULL) return -1;
+        memset(&timers[tpool->tCapacity], 0, sizeof(Timer) * (cap - tpool->tCapacity));
+        for (int i = cap - 1; i >= tpool->tCapacity; --i) {
+            timers[i].next = tpool->tFree;
+            timers[i].gen  = 1;
+            tpool->tFree   = i;
+        }
+        tpool->tCapacity = cap;
+    }
+    int slot = tpool->tFree;
+    tpool->tFree = tpool->timers[slot].next;
+    return slot;
+}
+
+// the slot's TimerID is stale from here on
+static void slot_free(ThreadPool* tpool, int slot) {
+    Timer *t = &tpool->timers[slot];
+    free(t->task.arg);
+    t->task.arg = NULL;
+    t->state = TIMER_FREE;
+    t->gen  += 1;
+    t->next  = tpool->tFree;
+    tpool->tFree = slot;
+}
+
+static TimerID timer_add(ThreadPool* tpool, long delayMs, long periodMs, void(*func)(void*), void* arg) {
+    pthread_mutex_lock(&tpool->mutexPool);
+    int slot;
+    if (tpool->shutdown || (slot = slot_alloc(tpool)) < 0) {
+        pthread_mutex_unlock(&tpool->mutexPool);
+        return -1;
+    }
+    Timer *t = &tpool->timers[slot];
+    t->task.entry = func;
+    t->task.arg   = arg;
+    t->when       = now_ns() + delayMs * 1000000LL;
+    t->period     = periodMs * 1000000LL;
+    heap_push(tpool, slot);
+    TimerID id = (TimerID)(t->gen & GEN_MASK) << 32 | slot;
+    pthread_mutex_unlock(&tpool->mutexPool);
+    return id;
+}
+
+TimerID tp_add_after(ThreadPool* tpool, long delayMs, void(*func)(void*), void* arg) {
+    return timer_add(tpool, delayMs, 0, func, arg);
+}
+
+TimerID tp_add_every(ThreadPool* tpool, long periodMs, void(*func)(void*), void* arg) {
+    if (periodMs <= 0) return -1;
+    return timer_add(tpool, periodMs, periodMs, func, arg);
+}
+
+int tp_cancel(ThreadPool* tpool, TimerID id) {
+    int slot = (int)(id & 0xffffffff), ret = 0;
+    pthread_mutex_lock(&tpool->mutexPool);
+    Timer *t = id >= 0 && slot >= 0 && slot < tpool->tCapacity ? &tpool->timers[slot] : NULL;
+    if (t == NULL || (t->gen & GEN_MASK) != (unsigned)(id >> 32) || t->state == TIMER_FREE) {
+        ret = -1;
+    } else if (t->state == TIMER_PENDING) {
+        heap_remove(tpool, t->heapIdx);
+        slot_free(tpool, slot);
+    } else {
+        t->state = TIMER_CANCELLED;     // running now, timer_done() frees it
+    }
+    pthread_mutex_unlock(&tpool->mutexPool);
+    return ret;
+}
+
+// after a timer's run: once more a period later, or gone
+static void timer_done(ThreadPool* tpool, int slot) {
+    pthread_mutex_lock(&tpool->mutexPool);
+    Timer *t = &tpool->timers[slot];
+    if (t->state == TIMER_CANCELLED || t->period == 0 || tpool->shutdown) {
+        slot_free(tpool, slot);
+    } else {
+        long long now = now_ns();
+        t->when += t->period;
+        if (t->when <= now)             // fell behind, skip the missed runs
+            t->when = now + t->period - (now - t->when) % t->period;
+        heap_push(tpool, slot);
+    }
+    pthread_mutex_unlock(&tpool->mutexPool);
+}
+
 int tp_busy(ThreadPool* tpool) {
     return tpool->busyNum;
 }
@@ -129,39 +544,102 @@ void* worker(void* arg) {
             assert(0);      // defensive wall
         }
 
-        // task queue is or not empty
-        while(tpool->qSize == 0 && !tpool->shutdown) {
-            pthread_cond_wait(&tpool->notEmpty, &tpool->mutexPool);
+        // wait for a task or a due timer; one idle worker at a time
+        // sleeps until the first deadline, the others until a task comes
+        int timer = -1;
+        TpRing *ring = NULL;
+        while (!tpool->shutdown) {
+            if (tpool->heapSize > 0 && tpool->timers[tpool->timerHeap[0]].when <= now_ns()) {
+                timer = tpool->timerHeap[0];
+                break;
+            }
+            // taskQ and the rings take turns
+            if (tpool->qSize > 0 && (tpool->ringTurn ^= 1)) break;
+            if ((ring = ring_next(tpool)) != NULL) break;
+            if (tpool->qSize > 0) break;
+
+            // idle from here, a producer that sees it takes the lock to wake us
+            __atomic_add_fetch(&tpool->idleNum, 1, __ATOMIC_SEQ_CST);
+            if ((ring = ring_next(tpool)) != NULL) {
+                __atomic_sub_fetch(&tpool->idleNum, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            if (tpool->heapSize > 0 && !tpool->timerWaiter) {
+                long long when = tpool->timers[tpool->timerHeap[0]].when;
+                struct timespec ts = { when / 1000000000LL, when % 1000000000LL };
+                tpool->timerWaiter = 1;
+                pthread_cond_timedwait(&tpool->notEmpty, &tpool->mutexPool, &ts);
+                tpool->timerWaiter = 0;
+            } else {
+                pthread_cond_wait(&tpool->notEmpty, &tpool->mutexPool);
+            }
+            __atomic_sub_fetch(&tpool->idleNum, 1, __ATOMIC_SEQ_CST);
         }
-        assert(tpool->qSize > 0);
 
         if (tpool->shutdown) {
             pthread_mutex_unlock(&tpool->mutexPool);
             thread_exit(tpool);
         }
 
-        // fetch a task from task queue
         Task task;
-        task.entry = tpool->taskQ[tpool->qFront].entry;
-        task.arg = tpool->taskQ[tpool->qFront].arg;
-
-        tpool->qFront = (tpool->qFront + 1) % tpool->qCapacity;
-        tpool->qSize -= 1;
-
-        // signal
-        pthread_cond_signal(&tpool->notFull);
+        if (timer >= 0) {
+            // fetch the due timer
+            heap_remove(tpool, 0);
+            tpool->timers[timer].state = TIMER_RUNNING;
+            task = tpool->timers[timer].task;
+        } else if (ring != NULL) {
+            // fetch a task from a producer's ring
+            unsigned head = ring->head;
+            task = ring->slots[head & ring->mask];
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+            if (ring->closed && ring->head == ring->tail) ring_free(tpool, ring);
+
+            // pairs with the fence in tp_ring_add: either the producer saw
+            // the ring empty and woke someone, or we see its task here
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (tpool->idleNum > 0 && ring_backlog(tpool) > 0)
+                pthread_cond_signal(&tpool->notEmpty);
+        } else {
+            // fetch a task from task queue
+            assert(tpool->qSize > 0);
+            task.entry = tpool->taskQ[tpool->qFront].entry;
+            task.arg = tpool->taskQ[tpool->qFront].arg;
+
+            tpool->qFront = (tpool->qFront + 1) % tpool->qCapacity;
+            tpool->qSize -= 1;
+
+            if (tpool->spillHead) {
+                // the oldest spilled task takes the free place
+                Spill *node = tpool->spillHead;
+                tpool->spillHead = node->next;
+                if (tpool->spillHead == NULL) tpool->spillTail = NULL;
+                tpool->spillSize -= 1;
+                enqueue(tpool, node->task.entry, node->task.arg);
+                free(node);
+            } else {
+                // signal
+                pthread_cond_signal(&tpool->notFull);
+            }
+        }
+        // someone else sleeps until the next deadline now
+        if (tpool->heapSize > 0 && !tpool->timerWaiter)
+            pthread_cond_signal(&tpool->notEmpty);
         pthread_mutex_unlock(&tpool->mutexPool);
 
         // start new task
-        printf("tid %ld start working ..\n", pthread_self());
+        debug("tid %ld start working ..\n", pthread_self());
         pthread_mutex_lock(&tpool->mutexBusy);
         tpool->busyNum += 1;
         pthread_mutex_unlock(&tpool->mutexBusy);
         task.entry((void *)task.arg);
-        free(task.arg);
+        if (timer >= 0) {
+            timer_done(tpool, timer);
+        } else {
+            free(task.arg);
+        }
         task.arg = NULL;
 
-        printf("tid %ld end working ..\n", pthread_self());
+        debug("tid %ld end working ..\n", pthread_self());
         pthread_mutex_lock(&tpool->mutexBusy);
         tpool->busyNum -= 1;
         pthread_mutex_unlock(&tpool->mutexBusy);
@@ -178,7 +656,7 @@ void* manager(void* arg) {
 
         // task numbers and thread numbers
         pthread_mutex_lock(&tpool->mutexPool);
-        int qSize = tpool->qSize;
+        int qSize = tpool->qSize + tpool->spillSize + ring_backlog(tpool);
         int liveNum = tpool->liveNum;
         int busyNum = tpool->busyNum;
         pthread_mutex_unlock(&tpool->mutexPool);
@@ -217,12 +695,19 @@ void* manager(void* arg) {
 
 void thread_exit(ThreadPool* tpool) {
     pthread_t tid = pthread_self();
+    pthread_mutex_lock(&tpool->mutexPool);
     for(int i = 0; i < tpool->maxNum; ++i) {
         if(tpool->threadIDs[i] == tid) {
-            tpool->threadIDs[i] = 0;
+            // tp_destroy() joins the workers left at shutdown, the
+            // manager's retirees join nobody
+            if (!tpool->shutdown) {
+                tpool->threadIDs[i] = 0;
+                pthread_detach(tid);
+            }
             printf("thread_exit() called, %ld exiting ..\n", tid);
             break;
         }
     }
+    pthread_mutex_unlock(&tpool->mutexPool);
     pthread_exit(NULL);
 }
\ No newline at end of file
@@ -8,12 +8,80 @@ typedef struct Task_t {
     void *arg;
 } Task;
 
+// what tp_add does when taskQ is full
+typedef enum {
+    TP_BLOCK = 0,               // wait for room (default)
+    TP_REJECT,                  // fail, the caller keeps arg
+    TP_CALLER_RUNS,             // run the task in the calling thread
+    TP_SPILL,                   // queue it on an unbounded overflow list
+} Overflow;
+
+typedef struct Spill_t {
+    Task task;
+    struct Spill_t *next;
+} Spill;
+
+typedef struct TpStats_t {
+    long added;                 // queued on taskQ, a blocked tp_add included
+    long blocked;               // tp_add waited for room (TP_BLOCK), queued or not
+    long rejected;              // refused: TP_REJECT, or tp_try_add on a full queue
+    long callerRuns;            // ran in the caller (TP_CALLER_RUNS)
+    long spilled;               // went to the overflow list (TP_SPILL)
+    long timedOut;              // tp_add_timed gave up
+    long ringAdded;             // queued on a producer's ring
+    int  spillSize;             // on the overflow list now
+} TpStats;
+
+struct ThreadPool_t;
+
+// one producer thread's submission ring: single producer, and the workers
+// holding mutexPool as the single consumer. Producer and consumer fields
+// sit on separate cache lines.
+typedef struct TpRing_t {
+    Task    *slots;
+    unsigned mask;              // capacity - 1, a power of two
+    struct ThreadPool_t *pool;
+
+    unsigned tail __attribute__((aligned(64)));    // next to fill, the producer
+    unsigned headCache;         // the producer's last look at head
+    long     added;             // tasks queued, by the producer
+
+    unsigned head __attribute__((aligned(64)));    // next to take, the workers
+    int      closed;            // tp_ring_close called, freed once empty
+} TpRing;
+
+typedef long long TimerID;      // slot and generation of a timer, -1 if none
+
+enum { TIMER_FREE = 0, TIMER_PENDING, TIMER_RUNNING, TIMER_CANCELLED };
+
+typedef struct Timer_t {
+    Task      task;
+    long long when;             // deadline, CLOCK_MONOTONIC ns
+    long long period;           // ns between runs, 0 runs once
+    int       heapIdx;          // index in timerHeap, -1 if not pending
+    int       next;             // next free slot
+    unsigned  gen;              // bumped when the slot is freed
+    int       state;
+} Timer;
+
 typedef struct ThreadPool_t {
     Task *taskQ;                // task queue
     int   qCapacity;            // queue capacity
     int   qSize;                // queue size
     int   qFront;               // head pointer of taskQ
     int   qRear;                // tail pointer of taskQ
+    Overflow policy;            // tp_add on a full taskQ
+    Spill *spillHead;           // overflow list, FIFO after taskQ
+    Spill *spillTail;
+    int   spillSize;
+    TpStats stats;
+
+    TpRing **rings;             // open producer rings, drained round-robin
+    int   nRings;
+    int   ringCap;
+    int   ringNext;             // ring to look at first
+    int   ringTurn;             // taskQ and the rings take turns
+    int   idleNum;              // workers waiting on notEmpty, atomic
 
     pthread_t  managerID;       // manageer thread
     pthread_t *threadIDs;       // threads pool
@@ -25,6 +93,13 @@ typedef struct ThreadPool_t {
     int exitNum;                // destroyed threads
     int shutdown;               // thread pool status 
 
+    Timer *timers;              // timer slots, a TimerID names one
+    int   tCapacity;            // slots allocated
+    int   tFree;                // first free slot, -1 if none
+    int  *timerHeap;            // pending slots, min-heap on deadline
+    int   heapSize;             // pending timers
+    int   timerWaiter;          // an idle worker sleeps until the first deadline
+
     pthread_mutex_t mutexPool;  // lock of thread pool
     pthread_mutex_t mutexBusy;  //
     pthread_cond_t  notFull;    // task queue isn't full
@@ -36,10 +111,41 @@ typedef struct ThreadPool_t {
 /* Thread Pooll API */
 ThreadPool* tp_create(int min, int max, int qSize);
 
+ThreadPool* tp_create_policy(int min, int max, int qSize, Overflow policy);
+
 int tp_destroy(ThreadPool* pool);
 
 int tp_add(ThreadPool* pool, void(*func)(void*), void* arg);
 
+/* never waits, -1 if taskQ is full; on -1 the caller keeps arg */
+int tp_try_add(ThreadPool* pool, void(*func)(void*), void* arg);
+
+/* waits at most timeoutMs for room, whatever the policy, -1 if there was none */
+int tp_add_timed(ThreadPool* pool, void(*func)(void*), void* arg, long timeoutMs);
+
+void tp_stats(ThreadPool* pool, TpStats* stats);
+
+/* a submission ring for the calling thread, capacity rounded up to a power
+ * of two: tp_ring_add takes no lock and shares no cache line with other
+ * producers, it falls back to tp_add when the ring is full (so tasks may
+ * then run out of order). One ring per producer thread, never shared.
+ * tp_ring_close gives it back, the tasks left in it still run. */
+TpRing* tp_ring_open(ThreadPool* pool, int capacity);
+
+int tp_ring_add(TpRing* ring, void(*func)(void*), void* arg);
+
+void tp_ring_close(TpRing* ring);
+
+/* run func(arg) once after delayMs, or every periodMs from periodMs on;
+ * arg is freed after a one-shot run, and after the last run of a periodic
+ * timer, when it is cancelled */
+TimerID tp_add_after(ThreadPool* pool, long delayMs, void(*func)(void*), void* arg);
+
+TimerID tp_add_every(ThreadPool* pool, long periodMs, void(*func)(void*), void* arg);
+
+/* 0 if the timer will not run again, -1 if it is not pending nor running */
+int tp_cancel(ThreadPool* pool, TimerID id);
+
 int tp_busy(ThreadPool* pool);
 
 int tp_alive(ThreadPool* pool);